@@ -0,0 +1,267 @@
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <cmath>
+#include <Eigen/Core>
+#include <render.h>
+#include <render_threading.h>
+#include <render_scene.h>
+#include <render_scenegraph.h>
+
+//Checks of the renderer that need no window:
+//	- steady frames do not allocate
+//	- the image does not depend on the thread count
+//	- both raster modes draw the same image
+//Returns non-zero if a check fails
+
+static std::atomic<bool> g_count_allocations{ false };
+static std::atomic<size_t> g_allocations{ 0 };
+
+void* operator new(size_t aSize)
+{
+	if (g_count_allocations)
+		g_allocations++;
+
+	if (void* ret = std::malloc(aSize ? aSize : 1))
+		return ret;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* aPtr) noexcept
+{
+	std::free(aPtr);
+}
+
+void operator delete(void* aPtr, size_t) noexcept
+{
+	std::free(aPtr);
+}
+
+namespace
+{
+	enum class eFrameMode { IMMEDIATE, DEFERRED, PIPELINED };
+
+	const char* mode_name(eFrameMode aMode)
+	{
+		switch (aMode)
+		{
+		case eFrameMode::IMMEDIATE:	return "immediate";
+		case eFrameMode::DEFERRED:	return "deferred";
+		case eFrameMode::PIPELINED:	return "pipelined";
+		}
+		return "";
+	}
+
+	void set_mode(SoftRender::Render& aRender, eFrameMode aMode)
+	{
+		aRender.setPipelined(eFrameMode::PIPELINED == aMode);
+		aRender.setDeferred(eFrameMode::IMMEDIATE != aMode);
+	}
+
+	//a colored sphere, instanced as a grid with slightly different depths
+	struct tScene {
+		SoftRender::tMesh sphere;
+		SoftRender::tMesh cube;
+		SoftRender::tMeshlets meshlets;
+		std::vector<Eigen::Matrix4f> instances;
+		Eigen::Matrix4f world;
+	};
+
+	tScene make_scene()
+	{
+		tScene ret;
+
+		const int rings = 40;
+		const int segments = 40;
+		for (int iRing = 0; iRing <= rings; iRing++) {
+			for (int iSegment = 0; iSegment < segments; iSegment++) {
+				const float theta = 3.14159f * iRing / rings;
+				const float phi = 6.28318f * iSegment / segments;
+				ret.sphere.positions.push_back(Eigen::Vector4f(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta), 1.0f));
+			}
+		}
+		for (int iRing = 0; iRing < rings; iRing++) {
+			for (int iSegment = 0; iSegment < segments; iSegment++) {
+				const uint32_t a = iRing * segments + iSegment;
+				const uint32_t b = iRing * segments + (iSegment + 1) % segments;
+				const uint32_t c = (iRing + 1) * segments + iSegment;
+				const uint32_t d = (iRing + 1) * segments + (iSegment + 1) % segments;
+				ret.sphere.indices.insert(ret.sphere.indices.end(), { a, b, c, b, d, c });
+				ret.sphere.triangle_colors.push_back(iRing * 77 + iSegment);
+				ret.sphere.triangle_colors.push_back(iRing * 99 + iSegment * 3);
+			}
+		}
+		ret.sphere.updateBounds();
+		ret.meshlets = SoftRender::tMeshlets::build(ret.sphere);
+
+		ret.cube = SoftRender::tMesh::from_triangles(SoftRender::generate_cube_lines());
+
+		for (int iInstance = 0; iInstance < 16; iInstance++) {
+			Eigen::Matrix4f instance = Eigen::Matrix4f::Identity();
+			instance(0, 3) = (iInstance % 4) * 0.7f - 1.0f;
+			instance(1, 3) = (iInstance / 4) * 0.7f - 1.0f;
+			instance(2, 3) = 12.0f + iInstance * 0.1f;
+			ret.instances.push_back(instance);
+		}
+
+		ret.world = Eigen::Matrix4f::Identity();
+		ret.world(2, 3) = 10.0f;
+
+		return ret;
+	}
+
+	//copy of the latest finished frame
+	std::vector<uint32_t> read_image(SoftRender::Render& aRender)
+	{
+		const uint32_t* pixels = static_cast<const uint32_t*>(aRender.getBuffer());
+		return std::vector<uint32_t>(pixels, pixels + aRender.pixelCount());
+	}
+
+	size_t count_differences(const std::vector<uint32_t>& aLeft, const std::vector<uint32_t>& aRight)
+	{
+		size_t ret = 0;
+		for (size_t iPixel = 0; iPixel < aLeft.size(); iPixel++) {
+			if (aLeft[iPixel] != aRight[iPixel])
+				ret++;
+		}
+		return ret;
+	}
+
+	//the whole frame loop: every draw path, command lists and a scene graph
+	//update, 10 frames counted after 100 frames of warm-up
+	bool check_allocations(const tScene& aScene)
+	{
+		bool ret = true;
+
+		SoftRender::ThreadPool pool(4);
+		SoftRender::Render render(320, 240, 4, &pool);
+		const auto fov = SoftRender::tFov(16.0f, Eigen::Vector2f(40, 40 / render.aspectRatio()), 40.0f);
+		const auto pipeline = render.createPipeline(SoftRender::tDrawOptions().color(0x123456).fov(fov));
+
+		SoftRender::StaticGeometry geometry;
+		geometry.add(aScene.sphere, aScene.world, pipeline);
+
+		SoftRender::CommandList commands;
+		for (auto iTriangle : SoftRender::generate_cube_lines()) {
+			for (auto& iVertex : iTriangle) {
+				iVertex = aScene.world * iVertex;
+			}
+			commands.drawTriangle(iTriangle, pipeline);
+		}
+
+		SoftRender::SceneGraph graph;
+		for (uint32_t iNode = 0; iNode < 3000; iNode++) {
+			graph.add(aScene.world, iNode ? iNode - 1 : SoftRender::NO_PARENT);
+		}
+
+		for (auto mode : { eFrameMode::IMMEDIATE, eFrameMode::DEFERRED, eFrameMode::PIPELINED }) {
+			set_mode(render, mode);
+
+			for (int iFrame = 0; iFrame < 110; iFrame++) {
+				if (100 == iFrame) {
+					g_allocations = 0;
+					g_count_allocations = true;
+				}
+
+				render.swap_buffer();
+				render.drawInstanced(aScene.sphere, aScene.instances, {}, pipeline);
+				render.drawMesh(aScene.sphere, aScene.world, pipeline);
+				render.drawMeshlets(aScene.sphere, aScene.meshlets, aScene.world, pipeline);
+				render.drawStatic(geometry, Eigen::Matrix4f::Identity(), pipeline);
+				render.submit(commands);
+				graph.setLocal(0, aScene.world);
+				graph.update(&pool);
+				render.getBuffer();
+			}
+			g_count_allocations = false;
+
+			std::cout << "allocations in 10 " << mode_name(mode) << " frames: " << g_allocations << std::endl;
+			ret = ret && 0 == g_allocations;
+		}
+
+		return ret;
+	}
+
+	//opaque instances, a wireframe cube and optionally transparent instances;
+	//pipelined frames are read back after a few frames in flight
+	std::vector<uint32_t> render_image(const tScene& aScene, int aThreads, eFrameMode aMode, SoftRender::eRasterMode aRasterMode, bool aTransparent)
+	{
+		SoftRender::ThreadPool pool(aThreads);
+		SoftRender::Render render(320, 240, 4, &pool);
+		render.setRasterMode(aRasterMode);
+		set_mode(render, aMode);
+
+		const auto fov = SoftRender::tFov(16.0f, Eigen::Vector2f(40, 40 / render.aspectRatio()), 40.0f);
+		const auto opaque = render.createPipeline(SoftRender::tDrawOptions().color(0x123456).fov(fov));
+		const auto wireframe = render.createPipeline(SoftRender::tDrawOptions().color(0x654321).fov(fov).wireframe(true));
+		const auto transparent = render.createPipeline(SoftRender::tDrawOptions().color(0x80FF0000).fov(fov).transparent(true).depth(SoftRender::eDepthMode::TEST));
+
+		const int frames = eFrameMode::PIPELINED == aMode ? 3 : 1;
+		for (int iFrame = 0; iFrame < frames; iFrame++) {
+			render.swap_buffer();
+			render.drawInstanced(aScene.sphere, aScene.instances, {}, opaque);
+			render.drawMesh(aScene.cube, aScene.world, wireframe);
+			if (aTransparent)
+				render.drawInstanced(aScene.sphere, aScene.instances, {}, transparent);
+		}
+		if (eFrameMode::PIPELINED == aMode)
+			render.swap_buffer();
+
+		return read_image(render);
+	}
+
+	//deferred and pipelined frames sort by depth, so at exactly equal depth
+	//a different triangle than in immediate mode may win; only the images
+	//of one mode are compared with each other
+	bool check_thread_counts(const tScene& aScene)
+	{
+		bool ret = true;
+		std::vector<uint32_t> immediate;
+
+		for (auto mode : { eFrameMode::IMMEDIATE, eFrameMode::DEFERRED, eFrameMode::PIPELINED }) {
+			const auto reference = render_image(aScene, 1, mode, SoftRender::eRasterMode::BANDS, true);
+			for (int threads : { 2, 4, 7 }) {
+				const size_t differences = count_differences(reference, render_image(aScene, threads, mode, SoftRender::eRasterMode::BANDS, true));
+				std::cout << mode_name(mode) << ", " << threads << " threads: " << differences << " pixels differ from 1 thread" << std::endl;
+				ret = ret && 0 == differences;
+			}
+
+			if (eFrameMode::IMMEDIATE == mode)
+				immediate = reference;
+			else
+				std::cout << mode_name(mode) << ": " << count_differences(immediate, reference) << " pixels differ from immediate at equal depth" << std::endl;
+		}
+
+		return ret;
+	}
+
+	//transparent draws would send a batch back to bands, so they are left out
+	bool check_raster_modes(const tScene& aScene)
+	{
+		bool ret = true;
+
+		for (int threads : { 1, 3, 4 }) {
+			for (auto mode : { eFrameMode::IMMEDIATE, eFrameMode::DEFERRED, eFrameMode::PIPELINED }) {
+				const size_t differences = count_differences(render_image(aScene, threads, mode, SoftRender::eRasterMode::BANDS, false), render_image(aScene, threads, mode, SoftRender::eRasterMode::PRIVATE_TARGETS, false));
+				std::cout << mode_name(mode) << ", " << threads << " threads: " << differences << " pixels differ between bands and private targets" << std::endl;
+				ret = ret && 0 == differences;
+			}
+		}
+
+		return ret;
+	}
+}
+
+int main()
+{
+	const tScene scene = make_scene();
+
+	bool ok = check_allocations(scene);
+	ok = check_thread_counts(scene) && ok;
+	ok = check_raster_modes(scene) && ok;
+
+	std::cout << (ok ? "all checks passed" : "a check failed") << std::endl;
+	return ok ? 0 : 1;
+}
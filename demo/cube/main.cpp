@@ -11,6 +11,7 @@
 #include <chrono>
 #include <render.h>
 #include <render_threading.h>
+#include <render_scenegraph.h>
 #include "../sdl2_helper.h"
 
 int reterr(int aRet, std::string aMsg)
@@ -24,13 +25,17 @@ int main(int argc, char* argv[])
 	constexpr size_t screen_width = 1024;
 	constexpr size_t screen_height = 768;
 
-	bool with_threading = true;
 	float focaldistance = 16.0f;
 	float rotation = 0.0f;
-	SoftRender::ThreadPool pool;
-	const auto cube_triangles = SoftRender::generate_cube_lines();
 	const std::array<uint32_t, 6> colors = { 0xfe4219, 0x85fe19, 0x19fef7, 0x1062fc, 0x535254, 0x070707 };
-	SoftRender::Render myRenderer(screen_width, screen_height, 4);
+
+	auto cube = SoftRender::tMesh::from_triangles(SoftRender::generate_cube_lines());
+	for (size_t iTriangle = 0; iTriangle < cube.triangleCount(); iTriangle++) {
+		cube.triangle_colors.push_back(colors[iTriangle % std::size(colors)]);
+	}
+	//one pool for the renderer and the scene updates
+	SoftRender::ThreadPool pool;
+	SoftRender::Render myRenderer(screen_width, screen_height, 4, &pool);
 	const int max_rows = 4;
 	const int max_cols = 4;
 
@@ -61,6 +66,34 @@ int main(int argc, char* argv[])
 
 	std::vector<SoftRender::tDrawOptions> draw_options = { drawopt_normal, drawopt_depth_wireframe, drawopt_depth_color };
 
+	//resolve the options once
+	std::vector<SoftRender::tPipelineHandle> pipelines;
+	for (const auto& iOpt : draw_options) {
+		pipelines.push_back(myRenderer.createPipeline(iOpt));
+	}
+
+	//record frame N+1 while frame N is rasterized
+	myRenderer.setPipelined(true);
+
+	//one grid node per cube with a spinning child; the world matrices
+	//are only recomputed when the rotation changes
+	SoftRender::SceneGraph scene;
+	std::vector<SoftRender::tNodeHandle> cube_nodes;
+	for (int iRow = 0; iRow < max_rows; iRow++) {
+		for (int iCol = 0; iCol < max_cols; iCol++) {
+			const float translation_x = iCol * 4.0f - (max_cols*1.5f);
+			const float translation_y = iRow * 4.0f - (max_rows * 1.5f);
+			Eigen::Matrix4f translation_matrix = Eigen::Matrix4f::Identity();
+			translation_matrix.col(3).head<3>() << translation_x, translation_y, 8.0f;
+
+			const auto grid_node = scene.add(translation_matrix);
+			cube_nodes.push_back(scene.add(Eigen::Matrix4f::Identity(), grid_node));
+		}
+	}
+	float scene_rotation = -1.0f;
+
+	std::vector<std::vector<Eigen::Matrix4f>> instances(pipelines.size());
+
 	render_helper::start_sdl2_loop(screen_width, screen_height, [&](SDL_Window* window, SDL_GLContext& context, SDL_Renderer* renderer, SDL_Texture* buffer) {
 		SDL_Event event;
 		while (SDL_PollEvent(&event)) {
@@ -90,51 +123,30 @@ int main(int argc, char* argv[])
 			//myRenderer.clear(0xFFFFFFFF);
 			myRenderer.swap_buffer();
 
-			for (int iRow = 0; iRow < max_rows; iRow++) {
-				for (int iCol = 0; iCol < max_cols; iCol++) {
-					const int col_row_idx = iCol + (max_cols * iRow);
-
-					auto curr_draw_opt = draw_options[col_row_idx % (draw_options.size())];
-
-					int tri_idx = 0;
-					for (auto iTriangle : cube_triangles) {
-						Eigen::Matrix3f aa = Eigen::AngleAxis<float>((2 * 3.1234f) * (rotation), Eigen::Vector3f(1.0f, 1.0f, 1.0f).normalized()).toRotationMatrix();
-						Eigen::Matrix4f rotation_matrix;
-						rotation_matrix.setIdentity();
-						rotation_matrix.block<3, 3>(0, 0) = aa;
-
-						const float translation_x = iCol * 4.0f - (max_cols*1.5f);
-						const float translation_y = iRow * 4.0f - (max_rows * 1.5f);
-						Eigen::Matrix4f translation_matrix = Eigen::Matrix4f::Identity();
-						translation_matrix.col(3).head<3>() << translation_x, translation_y, 8.0f;
+			if (rotation != scene_rotation) {
+				Eigen::Matrix3f aa = Eigen::AngleAxis<float>((2 * 3.1234f) * (rotation), Eigen::Vector3f(1.0f, 1.0f, 1.0f).normalized()).toRotationMatrix();
+				Eigen::Matrix4f rotation_matrix;
+				rotation_matrix.setIdentity();
+				rotation_matrix.block<3, 3>(0, 0) = aa;
 
-						const Eigen::Matrix4f world_matrix = translation_matrix * rotation_matrix;
-
-						auto fun = [iTriangle, world_matrix, tri_idx, &colors, &myRenderer, &curr_draw_opt]() -> void {
-							auto copy_opt = curr_draw_opt;
-							copy_opt.color(colors[tri_idx % std::size(colors)]);
-
-							auto curr_triangle = iTriangle;
-
-							for (auto& iEdge : curr_triangle) {
-								iEdge = world_matrix * iEdge;
-								//iEdge[2] += 4.0f;
-							}
-
-							myRenderer.drawTriangle(curr_triangle, copy_opt);
-						};
+				for (const auto iNode : cube_nodes) {
+					scene.setLocal(iNode, rotation_matrix);
+				}
+				scene_rotation = rotation;
+			}
+			scene.update(&pool);
 
-						if (with_threading)
-							pool.add(fun);
-						else
-							fun();
+			//one instance per cube, grouped by pipeline
+			for (auto& iInstances : instances) {
+				iInstances.clear();
+			}
 
-						tri_idx++;
-					}
+			for (size_t iCube = 0; iCube < cube_nodes.size(); iCube++) {
+				instances[iCube % instances.size()].push_back(scene.world(cube_nodes[iCube]));
+			}
 
-					if (with_threading)
-						pool.join();
-				}
+			for (size_t iPipeline = 0; iPipeline < pipelines.size(); iPipeline++) {
+				myRenderer.drawInstanced(cube, instances[iPipeline], {}, pipelines[iPipeline]);
 			}
 
 			void* buff = myRenderer.getBuffer();
@@ -37,13 +37,16 @@ int main(int argc, char* argv[])
 	constexpr size_t screen_width = 1024;
 	constexpr size_t screen_height = 768;
 
-	bool with_threading = false;
 	float focaldistance = 16.0f;
 	float rotation = 0.0f;
 	SoftRender::ThreadPool pool;
-	const auto cube_triangles = SoftRender::generate_cube_lines();
 	const std::array<uint32_t, 6> colors = { 0xfe4219, 0x85fe19, 0x19fef7, 0x1062fc, 0x535254, 0x070707 };
-	SoftRender::Render myRenderer(screen_width, screen_height, 4);
+
+	auto cube = SoftRender::tMesh::from_triangles(SoftRender::generate_cube_lines());
+	for (size_t iTriangle = 0; iTriangle < cube.triangleCount(); iTriangle++) {
+		cube.triangle_colors.push_back(colors[iTriangle % std::size(colors)]);
+	}
+	SoftRender::Render myRenderer(screen_width, screen_height, 4, &pool);
 	const int max_rows = 4;
 	const int max_cols = 4;
 
@@ -60,8 +63,32 @@ int main(int argc, char* argv[])
 		.fov(fov)
 		.wireframe(false);
 
+	const auto drawopt_depth_wireframe = SoftRender::tDrawOptions()
+		.color(0xAFFEE)
+		.fov(fov)
+		.wireframe(true);
+
+	const auto drawopt_depth_color = SoftRender::tDrawOptions()
+		.color(0xAFFEE)
+		.fov(fov)
+		.pixel_shader([](SoftRender::tPixelShaderData aData) -> uint32_t {
+			return 0x00112233;
+		});
+
 	std::vector<SoftRender::tDrawOptions> draw_options = { drawopt_normal, drawopt_depth_wireframe, drawopt_depth_color };
 
+	//resolve the options once
+	std::vector<SoftRender::tPipelineHandle> pipelines;
+	for (const auto& iOpt : draw_options) {
+		pipelines.push_back(myRenderer.createPipeline(iOpt));
+	}
+
+	//the frame is drawn as one batch: the renderer decides how many
+	//workers it is worth
+	myRenderer.setDeferred(true);
+
+	std::vector<std::vector<Eigen::Matrix4f>> instances(pipelines.size());
+
 	render_helper::start_sdl2_loop(screen_width, screen_height, [&](SDL_Window* window, SDL_GLContext& context, SDL_Renderer* renderer, SDL_Texture* buffer) {
 		SDL_Event event;
 		while (SDL_PollEvent(&event)) {
@@ -88,55 +115,35 @@ int main(int argc, char* argv[])
 		
 		//render stuff
 		{
-			myRenderer.clear(0xFFFFFFFF);
+			myRenderer.swap_buffer();
+
+			Eigen::Matrix3f aa = Eigen::AngleAxis<float>((2 * 3.1234f) * (rotation), Eigen::Vector3f(1.0f, 1.0f, 1.0f).normalized()).toRotationMatrix();
+			Eigen::Matrix4f rotation_matrix;
+			rotation_matrix.setIdentity();
+			rotation_matrix.block<3, 3>(0, 0) = aa;
+
+			//one instance per cube, grouped by pipeline
+			for (auto& iInstances : instances) {
+				iInstances.clear();
+			}
 
 			for (int iRow = 0; iRow < max_rows; iRow++) {
 				for (int iCol = 0; iCol < max_cols; iCol++) {
 					const int col_row_idx = iCol + (max_cols * iRow);
 
-					auto curr_draw_opt = draw_options[col_row_idx % (draw_options.size())];
-
-					int tri_idx = 0;
-					for (auto iTriangle : cube_triangles) {
-						Eigen::Matrix3f aa = Eigen::AngleAxis<float>((2 * 3.1234f) * (rotation), Eigen::Vector3f(1.0f, 1.0f, 1.0f).normalized()).toRotationMatrix();
-						Eigen::Matrix4f rotation_matrix;
-						rotation_matrix.setIdentity();
-						rotation_matrix.block<3, 3>(0, 0) = aa;
-
-						const float translation_x = iCol * 4.0f - (max_cols*1.5f);
-						const float translation_y = iRow * 4.0f - (max_rows * 1.5f);
-						Eigen::Matrix4f translation_matrix = Eigen::Matrix4f::Identity();
-						translation_matrix.col(3).head<3>() << translation_x, translation_y, 8.0f;
-
-						const Eigen::Matrix4f world_matrix = translation_matrix * rotation_matrix;
-
-						auto fun = [iTriangle, world_matrix, tri_idx, &colors, &myRenderer, &curr_draw_opt]() -> void {
-							auto copy_opt = curr_draw_opt;
-							copy_opt.color(colors[tri_idx % std::size(colors)]);
-
-							auto curr_triangle = iTriangle;
+					const float translation_x = iCol * 4.0f - (max_cols*1.5f);
+					const float translation_y = iRow * 4.0f - (max_rows * 1.5f);
+					Eigen::Matrix4f translation_matrix = Eigen::Matrix4f::Identity();
+					translation_matrix.col(3).head<3>() << translation_x, translation_y, 8.0f;
 
-							for (auto& iEdge : curr_triangle) {
-								iEdge = world_matrix * iEdge;
-								//iEdge[2] += 4.0f;
-							}
-
-							myRenderer.drawTriangle(curr_triangle, copy_opt);
-						};
-
-						if (with_threading)
-							pool.add(fun);
-						else
-							fun();
-
-						tri_idx++;
-					}
-
-					if (with_threading)
-						pool.join();
+					instances[col_row_idx % instances.size()].push_back(translation_matrix * rotation_matrix);
 				}
 			}
 
+			for (size_t iPipeline = 0; iPipeline < pipelines.size(); iPipeline++) {
+				myRenderer.drawInstanced(cube, instances[iPipeline], {}, pipelines[iPipeline]);
+			}
+
 			void* buff = myRenderer.getBuffer();
 			SDL_UpdateTexture(buffer, NULL, myRenderer.getBuffer(), screen_width * sizeof(Uint32));
 			SDL_RenderClear(renderer);
@@ -9,9 +9,15 @@
 #include <thread>
 #include <limits>
 #include <atomic>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <cstring>
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 #include "render_threading.h"
+#include "render_mesh.h"
 
 namespace SoftRender
 {
@@ -37,6 +43,31 @@ namespace SoftRender
 		float far_distance = 100.0f;
 	};
 
+	//where a volume lies relative to a tFrustum
+	enum class eCoverage {
+		OUTSIDE,
+		INTERSECTS,
+		INSIDE,
+	};
+
+	//View volume of a tFov in camera space (camera at origin, looking along +z).
+	//The near plane is z=0 like in the projection, the far plane is far_distance
+	struct tFrustum
+	{
+		tFrustum();
+		tFrustum(const tFov& aFov);
+
+		bool intersects_sphere(const Vector3f& aCenter, float aRadius) const;
+		bool intersects_aabb(const Vector3f& aMin, const Vector3f& aMax) const;
+		eCoverage classify_aabb(const Vector3f& aMin, const Vector3f& aMax) const;
+
+		//same volume in the space aView maps from (e.g. world space)
+		tFrustum transformed(const Matrix4f& aView) const;
+
+		//xyz: normal pointing inside, w: offset; inside if dot(plane, (p, 1)) >= 0
+		array<Vector4f, 6> planes;
+	};
+
 	//Structure of user overwriteable PixelShader
 	struct tPixelShaderData
 	{
@@ -58,6 +89,34 @@ namespace SoftRender
 		BRESEHAM_LIKE,
 	};
 
+	//Front faces: cross(v1-v0, v2-v0) points to the camera
+	enum class eCullMode {
+		NONE,
+		BACK,
+		FRONT,
+	};
+
+	enum class eDepthMode {
+		TEST_WRITE,
+		TEST,
+		DISABLED,
+	};
+
+	//How a batch is spread over the workers
+	enum class eRasterMode {
+		BANDS,				//triangles binned to row bands of the shared buffer
+		PRIVATE_TARGETS,	//each worker draws a share into its own target, merged by depth
+	};
+
+	//raster work of the last finished frame
+	struct tFrameStats {
+		size_t batches = 0;
+		size_t triangles = 0;
+		size_t pixels = 0;			//estimated from the triangle bounds
+		double raster_seconds = 0.0;	//summed over the batches
+		int32_t workers = 0;		//used by the last batch
+	};
+
 	//Option each Draw function accept
 	struct tDrawOptions
 	{
@@ -67,23 +126,181 @@ namespace SoftRender
 		tDrawOptions& fov(tFov aFov);
 		tDrawOptions& wireframe(bool aWireframe);
 		tDrawOptions& rasterizer(eRasterizer aRasterizer);
+		tDrawOptions& cull(eCullMode aCull);
+		tDrawOptions& depth(eDepthMode aDepth);
+		tDrawOptions& transparent(bool aTransparent);
 
 		optional<funcPixelShader> m_pixelshader;
 		optional<uint32_t> m_color;
 		optional<tFov> m_fov;
 		bool m_wireframe = false;
 		eRasterizer m_rasterizer = eRasterizer::BRESEHAM_LIKE;
+		eCullMode m_cull = eCullMode::NONE;
+		eDepthMode m_depth = eDepthMode::TEST_WRITE;
+		bool m_transparent = false;	//blend with the alpha of the color; keeps submission order when deferred
+	};
+
+	//Immutable, fully resolved draw state. Created once by Render::createPipeline
+	//and referenced by handle, so a draw neither copies nor re-resolves options
+	struct tPipelineState
+	{
+		tFov fov;
+		uint32_t color;
+		funcPixelShader pixelshader;	//empty if not set
+		bool wireframe;
+		eRasterizer rasterizer;
+		eCullMode cull;
+		eDepthMode depth;
+		bool transparent;
+		uint32_t id;	//handle; max() for temporary states
+
+		tFrustum frustum;
+
+		//projection factors resolved from fov and viewport
+		float screen_scale_x;
+		float screen_scale_y;
+		float inv_far;
+	};
+
+	typedef uint32_t tPipelineHandle;
+
+	class StaticScene;
+	class StaticGeometry;
+	class OcclusionBuffer;
+
+	//Records draws without touching the framebuffer. Use one list per
+	//recording thread and hand the lists to Render::submit in the wanted order
+	class CommandList
+	{
+	public:
+		void drawTriangle(const array<Vector4f, 3>& aVertices, tPipelineHandle aPipeline);
+		void drawTriangle(const Vector4f* aVertices, tPipelineHandle aPipeline);
+		void clear();
+		size_t size() const;
+
+	protected:
+		friend class Render;
+
+		struct tCommand {
+			array<Vector4f, 3> vertices;
+			tPipelineHandle pipeline;
+		};
+
+		vector<tCommand> m_commands;
+	};
+
+	//Leaves value-initialized elements uninitialized, so resize() does not
+	//touch the pages and they land on the NUMA node of their first writer
+	template<class T>
+	struct tDefaultInitAllocator : std::allocator<T>
+	{
+		template<class U>
+		struct rebind {
+			using other = tDefaultInitAllocator<U>;
+		};
+
+		tDefaultInitAllocator() = default;
+		template<class U>
+		tDefaultInitAllocator(const tDefaultInitAllocator<U>&) {}
+
+		template<class U>
+		void construct(U* aPtr)
+		{
+			::new (static_cast<void*>(aPtr)) U;
+		}
+
+		template<class U, class... Args>
+		void construct(U* aPtr, Args&&... aArgs)
+		{
+			::new (static_cast<void*>(aPtr)) U(std::forward<Args>(aArgs)...);
+		}
 	};
 
 	class Render
 	{
 	public:
-		Render(uint32_t aWidth, uint32_t aHeight, uint32_t aColorBytes);
+		//aExecutor (optional) is shared with the caller and must outlive the
+		//Render; without it the Render owns a pool of its own
+		Render(uint32_t aWidth, uint32_t aHeight, uint32_t aColorBytes, Executor* aExecutor = nullptr);
 		~Render();
 
-		void drawTriangle(vector<Vector4f> aVertices, const tDrawOptions& aDrawOptions);
-		void drawTriangle(array<Vector4f, 3> aVertices, const tDrawOptions& aDrawOptions);
-		void drawTriangle(Vector4f* aVertices, const tDrawOptions& aDrawOptions);
+		//pipelines are not thread safe: create them before drawing
+		tPipelineHandle createPipeline(const tDrawOptions& aDrawOptions);
+		const tPipelineState& pipeline(tPipelineHandle aPipeline) const;
+
+		void drawTriangle(const vector<Vector4f>& aVertices, const tDrawOptions& aDrawOptions);
+		void drawTriangle(const array<Vector4f, 3>& aVertices, const tDrawOptions& aDrawOptions);
+		void drawTriangle(const Vector4f* aVertices, const tDrawOptions& aDrawOptions);
+		void drawTriangle(const array<Vector4f, 3>& aVertices, tPipelineHandle aPipeline);
+		void drawTriangle(const Vector4f* aVertices, tPipelineHandle aPipeline);
+
+		//executes the lists in order; on equal depth the earlier draw wins
+		void submit(const CommandList& aList);
+		void submit(const vector<const CommandList*>& aLists);
+
+		//draws aCount instances of aMesh, parallelized across instances.
+		//aColors is optional (nullptr): per instance color, overrides mesh and pipeline color
+		void drawInstanced(const tMesh& aMesh, const Matrix4f* aTransforms, const uint32_t* aColors, size_t aCount, tPipelineHandle aPipeline);
+		void drawInstanced(const tMesh& aMesh, const vector<Matrix4f>& aTransforms, const vector<uint32_t>& aColors, tPipelineHandle aPipeline);
+		void drawMesh(const tMesh& aMesh, const Matrix4f& aTransform, tPipelineHandle aPipeline);
+
+		//draws straight from a caller owned vertex buffer, aTransform maps it to camera space.
+		//With a color in aLayout a triangle takes the color of its first vertex
+		void drawIndexed(const void* aVertices, const tVertexLayout& aLayout, const uint32_t* aIndices, size_t aIndexCount, const Matrix4f& aTransform, tPipelineHandle aPipeline);
+
+		//picks the level per instance from the projected size of level 0's bounds
+		void drawInstanced(const tMeshLod& aLod, const Matrix4f* aTransforms, const uint32_t* aColors, size_t aCount, tPipelineHandle aPipeline);
+		size_t selectLod(const tMeshLod& aLod, const Matrix4f& aTransform, tPipelineHandle aPipeline) const;
+
+		//projected diameter of the bounding sphere in pixels
+		float screenDiameter(const tBounds& aBounds, const Matrix4f& aTransform, tPipelineHandle aPipeline) const;
+
+		//draws the objects of aScene visible to aCamera; aView maps world to camera space.
+		//aOcclusion (optional) has to be set up with the same camera
+		void drawScene(const StaticScene& aScene, const Matrix4f& aView, tPipelineHandle aCamera, const OcclusionBuffer* aOcclusion = nullptr);
+
+		//draws the clusters of aGeometry that are inside the frustum of aCamera
+		//and, for pipelines culling back faces, not facing away as a whole
+		void drawStatic(const StaticGeometry& aGeometry, const Matrix4f& aView, tPipelineHandle aCamera);
+
+		//draws the meshlets of aMesh that pass the frustum, the normal cone (pipelines
+		//culling back faces) and, if given, aOcclusion set up with the same camera.
+		//aTransform maps to camera space and must not scale non-uniformly
+		void drawMeshlets(const tMesh& aMesh, const tMeshlets& aMeshlets, const Matrix4f& aTransform, tPipelineHandle aPipeline, const OcclusionBuffer* aOcclusion = nullptr);
+
+		//frustum test of transformed bounds, done per instance before any vertex work
+		bool isVisible(const tBounds& aBounds, const Matrix4f& aTransform, tPipelineHandle aPipeline) const;
+
+		//deferred: draws are queued per frame and executed sorted by flush(),
+		//which getBuffer() and swap_buffer() call. Opaque draws run front to
+		//back in 256 depth slabs, grouped by pipeline within each slab;
+		//transparent ones after in submission order. The reordering can change
+		//which of two triangles at exactly equal depth wins compared to immediate
+		//mode, typically a few hundred pixels of a frame.
+		//drawTriangle() may queue from several threads; the batch draws
+		//reuse member scratch and must not overlap with each other.
+		//flush() must not overlap with draws
+		void setDeferred(bool aDeferred);
+		void flush();
+
+		//pipelined (implies deferred): swap_buffer() hands the recorded frame
+		//to the workers and returns, so recording frame N+1 overlaps the raster
+		//of frame N. getBuffer() then waits for and returns the latest finished frame.
+		//setPipelined(false) goes back to the deferred setting from before
+		void setPipelined(bool aPipelined);
+
+		//PRIVATE_TARGETS needs no binning and no pixel locks, but a private
+		//color+depth target per worker: it suits moderate resolutions with
+		//very many triangles. Batches with transparent or non TEST_WRITE
+		//pipelines are still drawn in bands
+		void setRasterMode(eRasterMode aMode);
+		eRasterMode rasterMode() const;
+
+		//workers a raster batch is split over: 0 lets the renderer choose per
+		//batch from the measured cost of the previous ones, 1 draws on the
+		//calling thread only. Clamped to the executor's thread count
+		void setWorkerCount(int aWorkers);
+		tFrameStats frameStats() const;
 
 		void foreachPixel(std::function<void(uint32_t, uint32_t)> aFunc);
 		void swap_buffer();
@@ -102,11 +319,13 @@ namespace SoftRender
 
 		//Buffers
 		//TODO: make 2 buffers
+		//rows are first written by the clear of their band's worker
 		struct tRenderBuffer {
-			std::vector<uint32_t> color;
-			std::vector<float> depth;
+			std::vector<uint32_t, tDefaultInitAllocator<uint32_t>> color;
+			std::vector<float, tDefaultInitAllocator<float>> depth;
 			std::atomic<bool>* mutex;
-			std::atomic<bool> is_cleared;
+			FrameFence cleared;
+			bool is_initialized = false;	//cleared at least once
 		};
 
 		std::array<tRenderBuffer, 32> m_buffers;
@@ -116,18 +335,146 @@ namespace SoftRender
 		uint32_t m_default_color;
 		tFov m_default_fov;
 
-		ThreadPool m_pool;
+		//Pipelines
+		vector<unique_ptr<tPipelineState>> m_pipelines;
+
+		//pixel rectangle, x1/y1 exclusive
+		struct tRect {
+			int32_t x0, y0, x1, y1;
+		};
+
+		//color+depth target of one worker in eRasterMode::PRIVATE_TARGETS.
+		//Untouched pixels have infinite depth; only the drawn span of every
+		//row is merged and reset afterwards
+		struct tPrivateTarget {
+			tRenderBuffer buffer;	//no mutex: a single writer
+			vector<int32_t> row_x0;
+			vector<int32_t> row_x1;	//exclusive; row_x0 >= row_x1 if the row is clean
+			bool is_initialized = false;
+		};
+
+		//where a rasterizer writes to
+		struct tTarget {
+			tRenderBuffer* buffer;
+			tRect clip;
+			tPrivateTarget* exclusive = nullptr;	//set for private targets
+		};
+
+		//projected triangle, ready for rasterization
+		struct tSetupTriangle {
+			array<Vector4f, 3> vertices;
+			const tPipelineState* pipeline;
+			uint32_t color;
+			tRect bounds;
+			uint64_t sort_key;
+			bool is_valid;
+		};
+
+		vector<tSetupTriangle> m_submit_setups;
+
+		//mesh instance waiting for setup
+		struct tInstance {
+			const tMesh* mesh;
+			Matrix4f transform;
+			const tPipelineState* pipeline;
+			uint32_t color;
+			bool has_color;
+			size_t first_setup;
+		};
+
+		vector<tInstance> m_instances;
+		vector<uint32_t> m_scene_visible;
+		vector<size_t> m_cluster_first_setup;	//per visible static cluster or meshlet
+
+		//deferred frame queue
+		bool m_deferred = false;
+		mutex m_queue_mutex;
+		vector<tSetupTriangle> m_queue;
+		deque<tPipelineState> m_frame_pipelines;
+		optional<tDrawOptions> m_frame_options;	//options of m_frame_pipelines.back()
+
+		//jobs of rasterizing a batch of setups:
+		//sort (deferred only) -> bin chunks -> one raster job per worker,
+		//each drawing a contiguous run of bands
+		struct tStages {
+			vector<tSetupTriangle> sort_scratch;	//merge buffer
+			vector<vector<uint32_t>> bins;	//[chunk * band count + band]
+			size_t chunk_count = 0;
+			int32_t workers = 1;	//chosen for the batch
+			int32_t band_count = 1;	//= pool threads, the same split as the clear
+			int32_t band_height = 0;
+			size_t triangles = 0;
+			atomic<size_t> pixels{ 0 };
+			chrono::steady_clock::time_point start;
+			JobGraph graph;
+		};
+
+		static constexpr size_t BIN_CHUNK_SIZE = 4096;	//setups per bin job at least
+		static constexpr double TRIANGLE_WORK = 16.0;	//setup cost of a triangle in pixels
+
+		tStages m_stages;	//flush() and immediate draws
+
+		//pipelined frame, rasterized while the next one is recorded
+		struct tFrame {
+			vector<tSetupTriangle> setups;
+			deque<tPipelineState> pipelines;
+			tStages stages;
+		};
+
+		eRasterMode m_raster_mode = eRasterMode::BANDS;
+		vector<unique_ptr<tPrivateTarget>> m_private_targets;	//1 per worker
+
+		bool m_pipelined = false;
+		bool m_deferred_before_pipelined = false;	//restored by setPipelined(false)
+		tFrame m_inflight;
+		uint32_t m_front_idx = numeric_limits<uint32_t>::max();
+
+		unique_ptr<ThreadPool> m_own_pool;	//only without an external executor
+		Executor& m_pool;
+		InlineExecutor m_inline;
+
+		//worker count per batch, learned from the stats of earlier ones
+		ParallelismController m_controller;
+		mutable mutex m_stats_mutex;
+		tFrameStats m_frame_stats;
+		tFrameStats m_last_frame_stats;
+		double m_pixels_per_triangle = 0.0;	//running average
 	protected:
-		void impl_drawTriangleFilled(const Vector4f* aVertices, const tDrawOptions& aDrawOptions);
-		void impl_drawTriangleFilled_barycentric(const Vector4f* aVertices, const tDrawOptions& aDrawOptions);
-		void impl_drawTriangleFilled_breseham_like(const Vector4f* aVertices, const tDrawOptions& aDrawOptions);
-		void impl_setPixel(const Vector4f& aVertice, uint32_t aColor);
-		void impl_drawLine(const Vector4f& aVertice0, const Vector4f& aVertice1, uint32_t aColor);
+		void impl_drawTriangle(const Vector4f* aVertices, const tPipelineState& aPipeline);
+		void impl_enqueueTriangle(const Vector4f* aVertices, const tPipelineState& aPipeline);
+		bool impl_setupTriangle(const Vector4f* aVertices, const tPipelineState& aPipeline, tSetupTriangle& aSetup);
+		void impl_rasterTriangle(const tSetupTriangle& aSetup, const tTarget& aTarget);
+		void impl_rasterBands(vector<tSetupTriangle>& aSetups);
+		void impl_runStages(vector<tSetupTriangle>& aSetups, bool aSort, tStages& aStages, tRenderBuffer& aBuffer);
+		Executor& impl_beginStages(size_t aTriangleCount, tStages& aStages);
+		void impl_endStages(const tStages& aStages);
+		void impl_rotateStats();
+		void impl_addBandStages(vector<tSetupTriangle>& aSetups, const tJob* aSort, tStages& aStages, tRenderBuffer& aBuffer);
+		void impl_rasterBand(const vector<tSetupTriangle>& aSetups, const tStages& aStages, int32_t aBand, tRenderBuffer& aBuffer);
+		bool impl_isCompositable(const vector<tSetupTriangle>& aSetups) const;
+		void impl_addPrivateStages(vector<tSetupTriangle>& aSetups, const tJob* aSort, tStages& aStages, tRenderBuffer& aBuffer);
+		void impl_rasterPrivate(const vector<tSetupTriangle>& aSetups, size_t aFirst, size_t aEnd, tStages& aStages, tPrivateTarget& aTarget);
+		void impl_mergeBand(int32_t aBand, const tStages& aStages, tRenderBuffer& aBuffer);
+		void impl_executeSetups(vector<tSetupTriangle>& aSetups);
+		void impl_drawInstances();
+		void impl_submit(const CommandList* const* aLists, size_t aCount);
+		void impl_binChunk(const vector<tSetupTriangle>& aSetups, size_t aFirst, size_t aEnd, tStages& aStages, vector<uint32_t>* aBins);
+		void impl_sortSetups(vector<tSetupTriangle>& aSetups, vector<tSetupTriangle>& aScratch);
+		void impl_nextBuffer();
+		void impl_drawTriangleFilled(const Vector4f* aVertices, uint32_t aColor, const tPipelineState& aPipeline, const tTarget& aTarget);
+		void impl_drawTriangleFilled_barycentric(const Vector4f* aVertices, uint32_t aColor, const tPipelineState& aPipeline, const tTarget& aTarget);
+		void impl_drawTriangleFilled_breseham_like(const Vector4f* aVertices, uint32_t aColor, const tPipelineState& aPipeline, const tTarget& aTarget);
+		void impl_setPixel(const Vector4f& aVertice, uint32_t aColor, const tPipelineState& aPipeline, const tTarget& aTarget);
+		void impl_drawLine(const Vector4f& aVertice0, const Vector4f& aVertice1, uint32_t aColor, const tPipelineState& aPipeline, const tTarget& aTarget);
 		void impl_clear(uint32_t aColor, tRenderBuffer& aBuffer, bool aBackground);
 
 	protected:
 		uint32_t getPixelIndex(uint32_t aX, uint32_t aY);
-		bool projectPoint(Vector4f& aPoint, const tDrawOptions& aDrawOptions);
+		tRect screenRect() const;
+		int32_t bandHeight(int32_t aBandCount) const;
+		static size_t impl_boundsArea(const tSetupTriangle& aSetup);
+		tPipelineState resolvePipeline(const tDrawOptions& aDrawOptions);
+		bool projectPoint(Vector4f& aPoint, const tPipelineState& aPipeline);
 		float withOverHeight();
 		float normalized_depth(float aZ) const;
 
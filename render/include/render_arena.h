@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+namespace SoftRender
+{
+	using namespace std;
+
+	//Bump allocator of one thread for transient frame data. Render::swap_buffer
+	//starts a new frame and every arena rewinds on its first use after that,
+	//unless a scope is still open on it. Once the blocks have grown to the
+	//peak of a frame, allocating never touches the heap
+	class FrameArena
+	{
+	public:
+		struct tMark {
+			size_t block;
+			size_t offset;
+		};
+
+		static FrameArena& local();	//of the calling thread
+		static void next_frame();
+
+		FrameArena() = default;
+		FrameArena(const FrameArena&) = delete;
+		FrameArena& operator=(const FrameArena&) = delete;
+
+		void* allocate(size_t aSize, size_t aAlign);
+
+		//default constructed, never destructed: only for trivially destructible T
+		template<class T>
+		T* allocate(size_t aCount)
+		{
+			static_assert(is_trivially_destructible_v<T>, "arena memory is never destructed");
+			T* ret = static_cast<T*>(allocate(aCount * sizeof(T), alignof(T)));
+			uninitialized_default_construct_n(ret, aCount);
+			return ret;
+		}
+
+		tMark mark() const;
+		void rewind(const tMark& aMark);
+		size_t capacity() const;
+
+	protected:
+		friend class ArenaScope;
+
+		static constexpr size_t MIN_BLOCK_SIZE = 64 * 1024;
+
+		void impl_startFrame();
+
+		struct tBlock {
+			unique_ptr<char[]> data;
+			size_t size;
+		};
+
+		vector<tBlock> m_blocks;
+		size_t m_block = 0;		//current
+		size_t m_offset = 0;	//in the current block
+		int m_scopes = 0;
+		uint64_t m_frame = 0;
+
+		static atomic<uint64_t> s_frame;
+	};
+
+	//Allocations made through the scope are released when it ends
+	class ArenaScope
+	{
+	public:
+		ArenaScope();
+		~ArenaScope();
+
+		ArenaScope(const ArenaScope&) = delete;
+		ArenaScope& operator=(const ArenaScope&) = delete;
+
+		template<class T>
+		T* allocate(size_t aCount)
+		{
+			return m_arena.allocate<T>(aCount);
+		}
+
+	protected:
+		FrameArena& m_arena;
+		FrameArena::tMark m_mark;
+	};
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <optional>
+#include <Eigen/Core>
+
+namespace SoftRender
+{
+	using namespace Eigen;
+	using namespace std;
+
+	//Bounding box and enclosing sphere
+	struct tBounds
+	{
+		Vector3f min = Vector3f::Zero();
+		Vector3f max = Vector3f::Zero();
+		Vector3f center = Vector3f::Zero();
+		float radius = 0.0f;
+
+		static tBounds from_points(const Vector4f* aPoints, size_t aCount);
+
+		//sphere after aTransform (radius scaled by the largest axis scale)
+		void transformSphere(const Matrix4f& aTransform, Vector3f& aCenter, float& aRadius) const;
+	};
+
+	//Indexed triangle mesh
+	struct tMesh
+	{
+		vector<Vector4f> positions;
+		vector<uint32_t> indices;			//3 per triangle
+		vector<uint32_t> triangle_colors;	//optional, 1 per triangle
+		tBounds bounds;						//call updateBounds() after changing positions
+
+		size_t triangleCount() const;
+		void updateBounds();
+
+		//shares equal vertices between the triangles
+		static tMesh from_triangles(const vector<array<Vector4f, 3>>& aTriangles);
+	};
+
+	//Bounding sphere and normal cone of a triangle cluster
+	struct tClusterBounds
+	{
+		Vector3f center = Vector3f::Zero();
+		float radius = 0.0f;
+		Vector3f cone_axis = Vector3f::UnitZ();	//average front face normal
+		float cone_cutoff = 1.0f;					//1: the cone can not reject the cluster
+
+		//aIndices: 3 per triangle into aVertices
+		static tClusterBounds from_triangles(const Vector4f* aVertices, size_t aVertexCount, const uint8_t* aIndices, size_t aTriangleCount);
+
+		//all triangles face away from aCamera (same space as the bounds)
+		bool is_backfacing(const Vector3f& aCamera) const;
+	};
+
+	struct tMeshlet
+	{
+		uint32_t first_vertex;		//into tMeshlets::vertices
+		uint32_t vertex_count;
+		uint32_t first_triangle;	//into tMeshlets::indices / 3
+		uint32_t triangle_count;
+		tClusterBounds bounds;
+	};
+
+	//Mesh split into clusters of neighbouring triangles, culled as a whole
+	struct tMeshlets
+	{
+		vector<tMeshlet> meshlets;
+		vector<uint32_t> vertices;	//mesh vertex per meshlet vertex
+		vector<uint8_t> indices;	//3 per triangle, into the vertices of its meshlet
+		vector<uint32_t> triangles;	//mesh triangle per meshlet triangle
+
+		//grows each meshlet over shared vertices, preferring triangles
+		//that add the fewest new vertices
+		static tMeshlets build(const tMesh& aMesh, uint32_t aMaxTriangles = 124, uint32_t aMaxVertices = 64);
+	};
+
+	enum class eVertexFormat {
+		FLOAT3,
+		FLOAT4,
+		HALF3,
+		HALF4,
+		SNORM16_3,	//int16 mapped to [-1, 1]
+		SNORM16_4,
+	};
+
+	//Interleaved vertex buffer owned by the caller. Vertices are read in
+	//place, so the buffer needs no particular alignment
+	struct tVertexLayout
+	{
+		tVertexLayout& stride(uint32_t aStride);
+		tVertexLayout& position(uint32_t aOffset, eVertexFormat aFormat);
+		tVertexLayout& color(uint32_t aOffset);	//uint32_t 0xAARRGGBB
+
+		Vector4f fetchPosition(const void* aVertices, uint32_t aIdx) const;
+		uint32_t fetchColor(const void* aVertices, uint32_t aIdx) const;
+
+		uint32_t m_stride = sizeof(float) * 4;
+		uint32_t m_position_offset = 0;
+		eVertexFormat m_position_format = eVertexFormat::FLOAT4;
+		optional<uint32_t> m_color_offset;
+	};
+
+	//Detail levels of one mesh, finest first. A level is used as long as the
+	//projected diameter of the bounding sphere is at least its min_pixels
+	struct tMeshLod
+	{
+		vector<tMesh> levels;
+		vector<float> min_pixels;	//1 per level, descending
+
+		size_t select(float aScreenDiameter) const;
+	};
+}
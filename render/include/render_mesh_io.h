@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "render_mesh.h"
+
+namespace SoftRender
+{
+	using namespace std;
+
+	//Indexed mesh with the positions as separate x/y/z arrays
+	struct tMeshBuffers
+	{
+		vector<float> x;
+		vector<float> y;
+		vector<float> z;
+		vector<uint32_t> indices;	//3 per triangle
+
+		size_t vertexCount() const;
+		tMesh toMesh() const;
+	};
+
+	//Parsers read the file as a stream, polygons are triangulated as fans
+	tMeshBuffers load_obj(const string& aPath);
+	tMeshBuffers load_ply(const string& aPath);
+	tMeshBuffers load_mesh(const string& aPath);	//by extension
+
+	//Versioned binary cache: header, then x, y, z and the indices
+	constexpr uint32_t MESH_CACHE_VERSION = 1;
+	void write_mesh_cache(const string& aPath, const tMeshBuffers& aMesh);
+
+	//Memory mapped mesh cache, used in place without parsing
+	class MappedMeshCache
+	{
+	public:
+		MappedMeshCache(const string& aPath);
+		~MappedMeshCache();
+
+		MappedMeshCache(const MappedMeshCache&) = delete;
+		MappedMeshCache& operator=(const MappedMeshCache&) = delete;
+
+		size_t vertexCount() const;
+		size_t indexCount() const;
+		const float* x() const;
+		const float* y() const;
+		const float* z() const;
+		const uint32_t* indices() const;
+
+		tMesh toMesh() const;
+
+	protected:
+		void impl_unmap();
+
+		const uint8_t* m_data = nullptr;
+		size_t m_size = 0;
+		size_t m_vertex_count = 0;
+		size_t m_index_count = 0;
+
+#ifdef _WIN32
+		void* m_file = nullptr;
+		void* m_mapping = nullptr;
+#endif
+	};
+
+	//maps aCachePath if it is valid and not older than aSourcePath,
+	//otherwise parses aSourcePath and writes the cache first
+	unique_ptr<MappedMeshCache> load_mesh_cached(const string& aSourcePath, const string& aCachePath);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "render_mesh.h"
+
+namespace SoftRender
+{
+	//Reorders triangles so vertices are reused while still in a post
+	//transform cache of aCacheSize entries (Tipsify)
+	void optimize_vertex_cache(tMesh& aMesh, uint32_t aCacheSize = 16);
+
+	//Splits the cache optimized order into clusters and draws the outward
+	//facing ones first, so fewer pixels get shaded twice. aThreshold limits
+	//how much worse than the vertex cache order the result may get
+	void optimize_overdraw(tMesh& aMesh, uint32_t aCacheSize = 16, float aThreshold = 1.05f);
+
+	//Renumbers the vertices in order of first use
+	void optimize_vertex_fetch(tMesh& aMesh);
+
+	//all of the above
+	void optimize_mesh(tMesh& aMesh, uint32_t aCacheSize = 16, float aOverdrawThreshold = 1.05f);
+
+	//average transformed vertices per triangle with a FIFO cache
+	float vertex_cache_acmr(const vector<uint32_t>& aIndices, size_t aVertexCount, uint32_t aCacheSize = 16);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+#include <Eigen/Core>
+#include "render.h"
+
+namespace SoftRender
+{
+	using namespace Eigen;
+	using namespace std;
+
+	//Small depth buffer for software occlusion culling. Occluders write the
+	//farthest depth of each triangle only to pixels they cover completely,
+	//tested boxes use their nearest depth over all pixels they touch, so
+	//coverage and depth errors always favor visibility
+	class OcclusionBuffer
+	{
+	public:
+		OcclusionBuffer(uint32_t aWidth = 256, uint32_t aHeight = 128);
+
+		//aView maps world to camera space; clears the buffer
+		void setCamera(const tFov& aFov, const Matrix4f& aView);
+		void clear();
+
+		//aTransform maps the occluder to world space
+		void addOccluder(const tMesh& aMesh, const Matrix4f& aTransform);
+		void addOccluder(const Vector4f* aWorldTriangle);
+
+		//max depth mip chain, call after the last occluder. Until the next
+		//change the tests read a level where they cover at most 2x2 texels
+		void buildPyramid();
+
+		//world space box
+		bool isVisible(const Vector3f& aMin, const Vector3f& aMax) const;
+
+		//camera space sphere
+		bool isVisibleSphere(const Vector3f& aCenter, float aRadius) const;
+
+		uint32_t width() const;
+		uint32_t height() const;
+		const float* depth() const;
+
+	protected:
+		uint32_t m_width;
+		uint32_t m_height;
+		vector<float> m_depth;	//camera space z, row major
+
+		//level i + 1 of the max depth pyramid, level 0 is m_depth
+		struct tLevel {
+			uint32_t width;
+			uint32_t height;
+			vector<float> depth;
+		};
+		vector<tLevel> m_pyramid;
+		bool m_has_pyramid = false;
+
+		Matrix4f m_view;
+		float m_near_distance;
+		float m_scale_x;
+		float m_scale_y;
+
+	protected:
+		Vector3f project(const Vector4f& aCamera) const;
+		void impl_rasterOccluder(const Vector4f* aCameraTriangle);
+		bool impl_isRectVisible(const Vector4f* aCameraCorners) const;
+	};
+}
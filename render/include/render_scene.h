@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <Eigen/Core>
+#include "render.h"
+
+namespace SoftRender
+{
+	using namespace Eigen;
+	using namespace std;
+
+	class OcclusionBuffer;
+
+	//Static meshes in world space with a bounding volume hierarchy,
+	//built once at load time and traversed per frame
+	class StaticScene
+	{
+	public:
+		struct tObject {
+			const tMesh* mesh;
+			Matrix4f transform;		//mesh to world
+			tPipelineHandle pipeline;
+			Vector3f min;			//world space box
+			Vector3f max;
+		};
+
+		//the mesh must outlive the scene; returns the object index
+		uint32_t add(const tMesh& aMesh, const Matrix4f& aTransform, tPipelineHandle aPipeline);
+		void build();
+
+		//objects whose box intersects the (world space) frustum and, if given,
+		//is not hidden in aOcclusion. Hidden nodes skip their whole subtree
+		void query(const tFrustum& aFrustum, vector<uint32_t>& aVisible, const OcclusionBuffer* aOcclusion = nullptr) const;
+
+		size_t size() const;
+		const tObject& object(uint32_t aIdx) const;
+
+	protected:
+		static constexpr uint32_t MAX_LEAF_OBJECTS = 2;
+
+		//inner node: count == 0, children at first and first + 1
+		struct tNode {
+			Vector3f min;
+			Vector3f max;
+			uint32_t first;
+			uint32_t count;
+		};
+
+		vector<tObject> m_objects;
+		vector<uint32_t> m_order;	//object indices, leaves reference ranges of it
+		vector<tNode> m_nodes;
+		bool m_is_built = false;
+
+	protected:
+		void impl_build(uint32_t aNode, uint32_t aFirst, uint32_t aCount);
+		void impl_collect(uint32_t aNode, vector<uint32_t>& aVisible, const OcclusionBuffer* aOcclusion) const;
+	};
+
+	//Static meshes baked to world space once. The triangles are split into
+	//meshlets with a bounding sphere and a normal cone, so per frame only the
+	//view is applied and whole clusters are rejected before any vertex work
+	class StaticGeometry
+	{
+	public:
+		struct tCluster {
+			uint32_t first_vertex;
+			uint32_t vertex_count;
+			uint32_t first_triangle;
+			uint32_t triangle_count;
+			tPipelineHandle pipeline;
+			tClusterBounds bounds;	//world space
+		};
+
+		//the mesh is copied, see tMeshlets::build for the cluster limits
+		void add(const tMesh& aMesh, const Matrix4f& aTransform, tPipelineHandle aPipeline, uint32_t aMaxTriangles = 124, uint32_t aMaxVertices = 64);
+
+		size_t clusterCount() const;
+		const tCluster& cluster(uint32_t aIdx) const;
+
+		vector<Vector4f> positions;	//world space, grouped by cluster
+		vector<uint8_t> indices;	//3 per triangle, relative to first_vertex of its cluster
+		vector<uint32_t> colors;	//1 per triangle, the pipeline color if the mesh has none
+		vector<uint8_t> has_color;	//1 per triangle
+
+	protected:
+		vector<tCluster> m_clusters;
+	};
+}
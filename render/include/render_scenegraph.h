@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <Eigen/Core>
+#include "render_threading.h"
+
+namespace SoftRender
+{
+	using namespace Eigen;
+	using namespace std;
+
+	typedef uint32_t tNodeHandle;
+	constexpr tNodeHandle NO_PARENT = numeric_limits<tNodeHandle>::max();
+
+	//Transform hierarchy in flat arrays. Nodes are stored parent before child,
+	//world matrices are cached and only recomputed below changed nodes
+	class SceneGraph
+	{
+	public:
+		//the parent must already exist
+		tNodeHandle add(const Matrix4f& aLocal, tNodeHandle aParent = NO_PARENT);
+		void setLocal(tNodeHandle aNode, const Matrix4f& aLocal);
+
+		const Matrix4f& local(tNodeHandle aNode) const;
+		const Matrix4f& world(tNodeHandle aNode) const;	//as of the last update()
+		tNodeHandle parent(tNodeHandle aNode) const;
+		size_t size() const;
+
+		//recomputes the world matrices of changed nodes and their descendants.
+		//With aPool, large hierarchies update one depth level after another,
+		//the nodes of a level in parallel
+		void update(Executor* aPool = nullptr);
+
+	protected:
+		static constexpr size_t PARALLEL_MIN_NODES = 1024;
+
+		void impl_updateNode(tNodeHandle aNode);
+
+		vector<Matrix4f> m_local;
+		vector<Matrix4f> m_world;
+		vector<tNodeHandle> m_parent;
+		vector<uint8_t> m_dirty;
+		vector<vector<tNodeHandle>> m_levels;	//nodes per depth
+		vector<uint32_t> m_depth;
+		bool m_any_dirty = false;
+	};
+}
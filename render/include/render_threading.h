@@ -5,33 +5,412 @@
 #include <condition_variable>
 #include <functional>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <limits>
+#include <cstdint>
 #include <iostream>
 
 namespace SoftRender
 {
 	using namespace std;
 
-	class ThreadPool
+	//Bounded spinning before a thread parks: short waits skip the sleep and
+	//wake latency, long ones don't burn a core
+	class SpinWait
 	{
 	public:
-		ThreadPool();
+		//false once the budget is used up and the caller should park
+		bool spin();
+		static void cpu_pause();
+
+	protected:
+		static constexpr int PAUSE_COUNT = 64;
+		static constexpr int YIELD_COUNT = 16;
+
+		int m_count = 0;
+	};
+
+	//Move-only void() callable for the task queues. Closures of up to
+	//INLINE_SIZE bytes are stored in place, so adding a task does not
+	//allocate; bigger ones fall back to the heap
+	class Task
+	{
+	public:
+		static constexpr size_t INLINE_SIZE = 64;
+
+		Task() = default;
+		Task(std::nullptr_t) {}
+
+		template<class F, class = enable_if_t<!is_same_v<decay_t<F>, Task>>>
+		Task(F&& aFunction)
+		{
+			using T = decay_t<F>;
+			if constexpr (sizeof(T) <= INLINE_SIZE && alignof(T) <= alignof(std::max_align_t) && is_nothrow_move_constructible_v<T>) {
+				::new (static_cast<void*>(&m_storage)) T(std::forward<F>(aFunction));
+				m_ops = &tInlineOps<T>::ops;
+			}
+			else {
+				*reinterpret_cast<T**>(&m_storage) = new T(std::forward<F>(aFunction));
+				m_ops = &tHeapOps<T>::ops;
+			}
+		}
+
+		Task(Task&& aOther) noexcept;
+		Task& operator=(Task&& aOther) noexcept;
+		Task& operator=(std::nullptr_t);
+		~Task();
+
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+
+		void operator()();
+		explicit operator bool() const;
+
+	protected:
+		struct tOps {
+			void (*call)(void* aStorage);
+			void (*move)(void* aFrom, void* aTo);	//leaves aFrom destroyed
+			void (*destroy)(void* aStorage);
+		};
+
+		template<class T>
+		struct tInlineOps {
+			static void call(void* aStorage) { (*static_cast<T*>(aStorage))(); }
+			static void move(void* aFrom, void* aTo) { ::new (aTo) T(std::move(*static_cast<T*>(aFrom))); static_cast<T*>(aFrom)->~T(); }
+			static void destroy(void* aStorage) { static_cast<T*>(aStorage)->~T(); }
+			static constexpr tOps ops = { &call, &move, &destroy };
+		};
+
+		template<class T>
+		struct tHeapOps {
+			static void call(void* aStorage) { (**static_cast<T**>(aStorage))(); }
+			static void move(void* aFrom, void* aTo) { *static_cast<T**>(aTo) = *static_cast<T**>(aFrom); }
+			static void destroy(void* aStorage) { delete *static_cast<T**>(aStorage); }
+			static constexpr tOps ops = { &call, &move, &destroy };
+		};
+
+		std::aligned_storage_t<INLINE_SIZE, alignof(std::max_align_t)> m_storage;
+		const tOps* m_ops = nullptr;
+	};
+
+	//Non-owning reference to a callable, for arguments that are only
+	//called before the function returns. Never allocates
+	template<class Signature>
+	class FunctionRef;
+
+	template<class R, class... Args>
+	class FunctionRef<R(Args...)>
+	{
+	public:
+		template<class F, class = enable_if_t<!is_same_v<decay_t<F>, FunctionRef>>>
+		FunctionRef(F&& aFunction)
+			: m_object(const_cast<void*>(static_cast<const void*>(std::addressof(aFunction)))),
+			m_call([](void* aObject, Args... aArgs) -> R {
+				return (*static_cast<remove_reference_t<F>*>(aObject))(std::forward<Args>(aArgs)...);
+			})
+		{
+		}
+
+		R operator()(Args... aArgs) const
+		{
+			return m_call(m_object, std::forward<Args>(aArgs)...);
+		}
+
+	protected:
+		void* m_object;
+		R (*m_call)(void*, Args...);
+	};
+
+	//Bounded task deque of one worker. The owner pushes and pops at the back,
+	//other workers steal from the front. Guarded by a spinlock, the critical
+	//sections are only a few instructions
+	class WorkQueue
+	{
+	public:
+		WorkQueue();
+
+		bool push(Task& aTask);	//false if full, aTask is kept then
+		bool pop(Task& aTask);
+		bool steal(Task& aTask);
+
+	protected:
+		static constexpr size_t CAPACITY = 1024;
+
+		void lock();
+		void unlock();
+
+		atomic_flag m_lock = ATOMIC_FLAG_INIT;
+		vector<Task> m_tasks;	//ring buffer
+		size_t m_head = 0;	//oldest
+		size_t m_tail = 0;	//one past the newest
+	};
+
+	class Executor;
+
+	//Completion of a single task added by Executor::spawn
+	class TaskHandle
+	{
+	public:
+		TaskHandle() = default;
+		TaskHandle(const TaskHandle& aOther);
+		TaskHandle& operator=(const TaskHandle& aOther);
+		~TaskHandle();
+
+		void wait();	//runs other pending tasks meanwhile
+		bool is_done() const;
+
+	protected:
+		friend class Executor;
+
+		//holds the task too, so the queued closure is a pointer. Recycled
+		//once the task ran and no handle is left: spawning does not
+		//allocate once warmed up
+		struct tState {
+			Task func;
+			atomic<bool> is_done{ false };
+			atomic<int> refs{ 0 };	//handles + the queued task
+			mutex done_mutex;
+			condition_variable done_cond;
+		};
+
+		static tState* impl_acquire();
+		static void impl_release(tState* aState);
+
+		Executor* m_executor = nullptr;
+		tState* m_state = nullptr;
+
+		static mutex s_states_mutex;
+		static vector<unique_ptr<tState>> s_states;	//owns all states, free or not
+		static vector<tState*> s_free_states;
+	};
+
+	//Runs tasks for Render and whoever else shares it. Implement add and
+	//threadCount to plug in an application scheduler; the loops and waits
+	//are built on top of them
+	class Executor
+	{
+	public:
+		virtual ~Executor() = default;
+
+		virtual void add(Task aFunction) = 0;
+		virtual int threadCount() const = 0;
+
+		//runs aFunction on worker aWorker (mod threadCount) where the executor
+		//supports placement, so repeated work on the same data stays on the
+		//same core. Falls back to add()
+		virtual void add_to(int aWorker, Task aFunction);
+
+		//runs one pending task on the calling thread, false if there was none
+		virtual bool try_run_one();
+
+		TaskHandle spawn(Task aFunction);
+
+		//calls aFunc(begin, end) on chunks of at least aGrain indices. The
+		//caller works on chunks too and only waits for this loop, not the pool
+		void parallel_for(size_t aBegin, size_t aEnd, size_t aGrain, FunctionRef<void(size_t, size_t)> aFunc);
+
+		//calls aFunc(x0, y0, x1, y1) per tile of a aWidth x aHeight area, x1/y1 exclusive
+		void parallel_for_tiles(uint32_t aWidth, uint32_t aHeight, uint32_t aTileWidth, uint32_t aTileHeight, FunctionRef<void(uint32_t, uint32_t, uint32_t, uint32_t)> aFunc);
+	};
+
+	struct tPoolOptions
+	{
+		tPoolOptions& threads(int aThreadCount);
+		tPoolOptions& pin(bool aPin);
+		tPoolOptions& numa_order(bool aNumaOrder);
+
+		int m_threads = 0;			//0: one per hardware thread
+		bool m_pin = false;			//bind every worker to one core
+		bool m_numa_order = false;	//neighbouring workers share a NUMA node
+	};
+
+	//Runs every task right away on the calling thread, for work too small
+	//to be worth handing to other threads
+	class InlineExecutor : public Executor
+	{
+	public:
+		void add(Task aFunction) override;
+		int threadCount() const override;
+	};
+
+	//Work stealing pool: every worker runs its own queue and steals from the
+	//others when it runs dry. add() never blocks. The threads are started
+	//by the first add(), so unused pools cost nothing
+	class ThreadPool : public Executor
+	{
+	public:
+		ThreadPool(int aThreadCount = 0);	//0: one per hardware thread
+		ThreadPool(const tPoolOptions& aOptions);
 		virtual ~ThreadPool();
 
-		void add(std::function<void()> aFunction);
-		void join();
+		void add(Task aFunction) override;
+		void add_to(int aWorker, Task aFunction) override;	//never stolen when pinned
+		void join();	//waits until all tasks of all callers have finished, see TaskGroup
+		int threadCount() const override;
+		bool try_run_one() override;
+
+		int cpuOf(int aWorker) const;	//-1 if not pinned
 
 	protected:
+		void impl_start();
+		void impl_worker(int aWorker);
+		bool impl_take(int aWorker, bool aIsOwner, Task& aTask);
+		void impl_finish();
+		void impl_pin(int aWorker);
+
 		int m_max_threads = 0;
+		tPoolOptions m_options;
+		vector<int> m_cpus;		//core of every worker when pinned
 
-		mutex m_mutex;
 		vector<thread> m_threads;
-		vector<function<void()>> m_next_func;
-		condition_variable m_cond_start;
-		condition_variable m_cond_ready;
-		vector<bool> m_is_free;
-		bool m_end_threads;
+		atomic<bool> m_is_started{ false };
+		vector<unique_ptr<WorkQueue>> m_queues;		//1 per worker
+		vector<unique_ptr<WorkQueue>> m_private;	//1 per worker, only the owner pops
+		unique_ptr<atomic<int>[]> m_private_queued;
+		atomic<uint32_t> m_next_queue{ 0 };		//round robin for outside threads
+
+		atomic<int> m_queued{ 0 };		//in a shared queue, not taken yet
+		atomic<int> m_pending{ 0 };		//added, not finished yet
+		atomic<int> m_sleeping{ 0 };
 
-		vector<int> m_called;
+		mutex m_mutex;
+		condition_variable m_cond_work;
+		condition_variable m_cond_done;
+		bool m_end_threads = false;
 	};
-}
 
+	//Tasks that are waited for together, independent of other work in the
+	//pool. The waiting thread runs pending tasks instead of only sleeping
+	class TaskGroup
+	{
+	public:
+		TaskGroup(Executor& aExecutor);
+		~TaskGroup();	//waits
+
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup& operator=(const TaskGroup&) = delete;
+
+		void add(Task aFunction);
+		void wait();
+		bool is_done() const;
+
+	protected:
+		Executor& m_executor;
+		atomic<int> m_pending{ 0 };
+		mutex m_mutex;
+		condition_variable m_cond;
+	};
+
+	typedef uint32_t tJob;
+
+	//Jobs with dependencies, e.g. the stages of a frame. A job is handed to
+	//the executor as soon as the jobs it depends on are done, so no stage
+	//waits for the whole pool. Build, run, wait, then clear and reuse: the
+	//storage is kept, so rebuilding the same graph does not allocate
+	class JobGraph
+	{
+	public:
+		JobGraph() = default;
+		~JobGraph();	//waits
+
+		JobGraph(const JobGraph&) = delete;
+		JobGraph& operator=(const JobGraph&) = delete;
+
+		//aWorker >= 0 places the job with Executor::add_to
+		tJob add(Task aFunction, int aWorker = -1);
+		void depend(tJob aJob, tJob aOn);	//aJob starts after aOn
+
+		void run(Executor& aExecutor);	//does not block
+		void wait();	//runs other pending tasks meanwhile
+		bool is_done() const;
+		void clear();	//waits first
+		size_t size() const;
+		void reserve(size_t aJobs, size_t aDependencies);	//storage is kept by clear()
+
+	protected:
+		void impl_launch(tJob aJob);
+		void impl_finish(tJob aJob);
+
+		static constexpr uint32_t NO_EDGE = numeric_limits<uint32_t>::max();
+
+		struct tNode {
+			Task function;
+			int worker;
+			int dependency_count;
+			uint32_t first_dependent;	//into m_edges
+		};
+
+		struct tEdge {
+			tJob job;
+			uint32_t next;
+		};
+
+		Executor* m_executor = nullptr;
+		vector<tNode> m_nodes;
+		vector<tEdge> m_edges;
+		unique_ptr<atomic<int>[]> m_remaining;	//dependencies not done yet, per job
+		size_t m_remaining_size = 0;
+
+		atomic<int> m_pending{ 0 };
+		mutex m_mutex;
+		condition_variable m_cond;
+	};
+
+	//Picks how many workers a batch of work is spread over, 1 meaning the
+	//calling thread alone. Every candidate keeps a linear cost model
+	//(time = overhead + cost * work) fitted from reported batches, which
+	//forgets old ones; the candidate predicted fastest for the given work
+	//wins, and now and then a neighbour is tried to keep its model fresh
+	class ParallelismController
+	{
+	public:
+		ParallelismController(int aMaxWorkers);
+
+		void setFixed(int aWorkers);	//0: adaptive
+		int choose(double aWork);
+		void report(int aWorkers, double aWork, double aSeconds);
+		int maxWorkers() const;
+
+	protected:
+		static constexpr double DECAY = 0.9;			//weight of older samples
+		static constexpr size_t MIN_SAMPLES = 3;		//before a model is trusted
+		static constexpr size_t EXPLORE_INTERVAL = 32;	//choices between two tries of a neighbour
+
+		struct tModel {
+			int workers;
+			size_t samples = 0;
+			double weight = 0.0;
+			double sum_work = 0.0;
+			double sum_time = 0.0;
+			double sum_work2 = 0.0;
+			double sum_work_time = 0.0;
+		};
+
+		double impl_predict(const tModel& aModel, double aWork) const;
+
+		vector<tModel> m_models;	//1, 2, 4, ... up to the max
+		int m_fixed = 0;
+		size_t m_choices = 0;
+		mutable mutex m_mutex;
+	};
+
+	//Signaled when all pending work items of a frame have called signal().
+	//Waits spin briefly before they park
+	class FrameFence
+	{
+	public:
+		void reset(int aPending);
+		void signal();
+		void wait();
+		bool is_signaled();
+
+	protected:
+		mutex m_mutex;
+		condition_variable m_cond;
+		atomic<int> m_pending{ 0 };
+	};
+}
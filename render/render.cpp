@@ -1,4 +1,12 @@
 #include "render.h"
+#include "render_scene.h"
+#include "render_occlusion.h"
+#include "render_arena.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SOFTRENDER_SSE2
+#endif
 
 namespace SoftRender
 {
@@ -6,7 +14,7 @@ namespace SoftRender
 	// helper
 	//---------------------------------------------------------
 	template<typename T_FUNC>
-	void pixel_lock(std::atomic<bool>& aLock, T_FUNC& aFunc) {
+	void pixel_lock(std::atomic<bool>& aLock, T_FUNC&& aFunc) {
 		//Reference: https://stackoverflow.com/questions/15056237/which-is-more-efficient-basic-mutex-lock-or-atomic-integer
 		
 		while (aLock.exchange(true, std::memory_order_relaxed));
@@ -18,6 +26,75 @@ namespace SoftRender
 		aLock.store(false, std::memory_order_relaxed);
 	}
 
+	//source over destination, alpha taken from the source color (0xAARRGGBB)
+	inline uint32_t blend(uint32_t aSrc, uint32_t aDst)
+	{
+		const uint32_t alpha = aSrc >> 24;
+		const uint32_t inv_alpha = 255 - alpha;
+
+		const uint32_t rb = (((aSrc & 0x00FF00FF) * alpha + (aDst & 0x00FF00FF) * inv_alpha) >> 8) & 0x00FF00FF;
+		const uint32_t g = (((aSrc & 0x0000FF00) * alpha + (aDst & 0x0000FF00) * inv_alpha) >> 8) & 0x0000FF00;
+
+		return (aDst & 0xFF000000) | rb | g;
+	}
+
+	//shaders compare equal only when both are empty or wrap the same function
+	//pointer; lambdas and functors never match, which just costs a new pipeline
+	inline bool same_options(const tDrawOptions& aLeft, const tDrawOptions& aRight)
+	{
+		typedef uint32_t(*tShaderPtr)(tPixelShaderData);
+
+		if (aLeft.m_pixelshader.has_value() != aRight.m_pixelshader.has_value())
+			return false;
+		if (aLeft.m_pixelshader.has_value()) {
+			const auto left = aLeft.m_pixelshader->target<tShaderPtr>();
+			const auto right = aRight.m_pixelshader->target<tShaderPtr>();
+			const bool both_empty = !*aLeft.m_pixelshader && !*aRight.m_pixelshader;
+			if (!both_empty && (!left || !right || *left != *right))
+				return false;
+		}
+
+		if (aLeft.m_fov.has_value() != aRight.m_fov.has_value())
+			return false;
+		if (aLeft.m_fov.has_value() && (aLeft.m_fov->near_distance != aRight.m_fov->near_distance || aLeft.m_fov->near_plane != aRight.m_fov->near_plane || aLeft.m_fov->far_distance != aRight.m_fov->far_distance))
+			return false;
+
+		return aLeft.m_color == aRight.m_color
+			&& aLeft.m_wireframe == aRight.m_wireframe
+			&& aLeft.m_rasterizer == aRight.m_rasterizer
+			&& aLeft.m_cull == aRight.m_cull
+			&& aLeft.m_depth == aRight.m_depth
+			&& aLeft.m_transparent == aRight.m_transparent;
+	}
+
+	//takes the source pixels that are strictly nearer, so on equal depth
+	//the destination (drawn earlier) wins like in the shared buffer
+	void composite_min_depth(const uint32_t* aSrcColor, const float* aSrcDepth, uint32_t* aDstColor, float* aDstDepth, size_t aCount)
+	{
+		size_t iPixel = 0;
+
+#ifdef SOFTRENDER_SSE2
+		for (; iPixel + 4 <= aCount; iPixel += 4) {
+			const __m128 src_depth = _mm_loadu_ps(aSrcDepth + iPixel);
+			const __m128 dst_depth = _mm_loadu_ps(aDstDepth + iPixel);
+			const __m128i nearer = _mm_castps_si128(_mm_cmplt_ps(src_depth, dst_depth));
+
+			const __m128i src_color = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aSrcColor + iPixel));
+			const __m128i dst_color = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aDstColor + iPixel));
+
+			_mm_storeu_ps(aDstDepth + iPixel, _mm_min_ps(src_depth, dst_depth));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(aDstColor + iPixel), _mm_or_si128(_mm_and_si128(nearer, src_color), _mm_andnot_si128(nearer, dst_color)));
+		}
+#endif
+
+		for (; iPixel < aCount; iPixel++) {
+			if (aSrcDepth[iPixel] < aDstDepth[iPixel]) {
+				aDstDepth[iPixel] = aSrcDepth[iPixel];
+				aDstColor[iPixel] = aSrcColor[iPixel];
+			}
+		}
+	}
+
 	//---------------------------------------------------------
 	// DrawOption
 	//---------------------------------------------------------
@@ -56,16 +133,61 @@ namespace SoftRender
 		return *this;
 	}
 
+	tDrawOptions& tDrawOptions::cull(eCullMode aCull)
+	{
+		m_cull = aCull;
+		return *this;
+	}
+
+	tDrawOptions& tDrawOptions::depth(eDepthMode aDepth)
+	{
+		m_depth = aDepth;
+		return *this;
+	}
+
+	tDrawOptions& tDrawOptions::transparent(bool aTransparent)
+	{
+		m_transparent = aTransparent;
+		return *this;
+	}
+
+
+	//---------------------------------------------------------
+	// CommandList
+	//---------------------------------------------------------
+	void CommandList::drawTriangle(const array<Vector4f, 3>& aVertices, tPipelineHandle aPipeline)
+	{
+		m_commands.push_back({ aVertices, aPipeline });
+	}
+
+	void CommandList::drawTriangle(const Vector4f* aVertices, tPipelineHandle aPipeline)
+	{
+		m_commands.push_back({ { aVertices[0], aVertices[1], aVertices[2] }, aPipeline });
+	}
+
+	void CommandList::clear()
+	{
+		m_commands.clear();
+	}
+
+	size_t CommandList::size() const
+	{
+		return m_commands.size();
+	}
+
 
 	//---------------------------------------------------------
 	// Render
 	//---------------------------------------------------------
-	Render::Render(uint32_t aWidth, uint32_t aHeight, uint32_t aColorBytes)
+	Render::Render(uint32_t aWidth, uint32_t aHeight, uint32_t aColorBytes, Executor* aExecutor)
 		:	m_width(aWidth), m_height(aHeight), 
 			m_color_bytes(aColorBytes), 
 			m_default_color((~aColorBytes)&0x00FFFFFF),
 			m_default_fov(8.0f, Eigen::Vector2f(40, 40 / this->aspectRatio()), 10.0f),
-			m_buff_idx(0)
+			m_buff_idx(0),
+			m_own_pool(aExecutor ? nullptr : make_unique<ThreadPool>()),
+			m_pool(aExecutor ? *aExecutor : *m_own_pool),
+			m_controller(m_pool.threadCount())
 	{
 		for (auto& iBuff : m_buffers) {
 			iBuff.color.resize(this->pixelCount() * m_color_bytes);
@@ -76,14 +198,22 @@ namespace SoftRender
 			for (uint32_t iMutex = 0; iMutex < this->pixelCount(); iMutex++) {
 				new (&iBuff.mutex[iMutex]) std::atomic<bool>();
 			}
-
-			impl_clear(m_default_color, iBuff, false);
 		}
+
+		//only the first buffer is needed right away and it is cleared
+		//here, so constructing starts no pool thread; the others are
+		//cleared by their bands' workers when they first come up
+		std::fill(buff().color.begin(), buff().color.begin() + pixelCount(), m_default_color);
+		std::fill(buff().depth.begin(), buff().depth.begin() + pixelCount(), 1.0f);
+		buff().is_initialized = true;
 	}
 
 	Render::~Render()
 	{
-		m_pool.join();
+		m_inflight.stages.graph.wait();
+		for (auto& iBuff : m_buffers) {
+			iBuff.cleared.wait();
+		}
 
 		for (auto& iBuff : m_buffers) {
 			for (uint32_t iMutex = 0; iMutex < this->pixelCount(); iMutex++) {
@@ -104,18 +234,142 @@ namespace SoftRender
 
 	void Render::swap_buffer()
 	{
+		FrameArena::next_frame();
+
+		if (m_pipelined) {
+			//frame N-1 is presented by now: recycle its buffer
+			m_inflight.stages.graph.wait();
+			impl_rotateStats();
+			if (m_front_idx < m_buffers.size()) {
+				impl_clear(m_default_color, m_buffers[m_front_idx], true);
+			}
+
+			//hand frame N to the workers, recording of N+1 starts right
+			//away; even the sort runs as a job
+			std::swap(m_inflight.setups, m_queue);
+			std::swap(m_inflight.pipelines, m_frame_pipelines);
+			m_queue.clear();
+			m_frame_pipelines.clear();
+			m_frame_options.reset();
+
+			impl_runStages(m_inflight.setups, true, m_inflight.stages, buff());
+			m_front_idx = m_buff_idx;
+
+			impl_nextBuffer();
+			return;
+		}
+
+		flush();
+		impl_rotateStats();
+
 		impl_clear(m_default_color, buff(), true);
 
+		impl_nextBuffer();
+	}
+
+	void Render::impl_rotateStats()
+	{
+		//only once the frame's batches are done reporting
+		scoped_lock lck(m_stats_mutex);
+		m_last_frame_stats = m_frame_stats;
+		m_frame_stats = tFrameStats();
+	}
+
+	void Render::impl_nextBuffer()
+	{
 		m_buff_idx++;
 		if (m_buff_idx >= m_buffers.size()) {
 			m_buff_idx = 0;
 		}
 
-		while( !buff().is_cleared );
-		m_pool.join();
+		if (!buff().is_initialized)
+			impl_clear(m_default_color, buff(), false);
+
+		buff().cleared.wait();
+	}
+
+	void Render::setPipelined(bool aPipelined)
+	{
+		flush();
+
+		//no pipelined swap recycles the presented buffer anymore
+		if (m_front_idx < m_buffers.size())
+			impl_clear(m_default_color, m_buffers[m_front_idx], true);
+		m_front_idx = numeric_limits<uint32_t>::max();
+
+		if (aPipelined && !m_pipelined)
+			m_deferred_before_pipelined = m_deferred;
+		else if (!aPipelined && m_pipelined)
+			m_deferred = m_deferred_before_pipelined;
+
+		m_pipelined = aPipelined;
+		m_deferred = m_deferred || aPipelined;
+	}
+
+	void Render::setRasterMode(eRasterMode aMode)
+	{
+		flush();
+
+		m_raster_mode = aMode;
+	}
+
+	eRasterMode Render::rasterMode() const
+	{
+		return m_raster_mode;
+	}
+
+	void Render::setWorkerCount(int aWorkers)
+	{
+		m_controller.setFixed(aWorkers);
+	}
+
+	tFrameStats Render::frameStats() const
+	{
+		scoped_lock lck(m_stats_mutex);
+		return m_last_frame_stats;
+	}
+
+	tPipelineHandle Render::createPipeline(const tDrawOptions& aDrawOptions)
+	{
+		const auto handle = static_cast<tPipelineHandle>(m_pipelines.size());
+
+		m_pipelines.push_back(std::make_unique<tPipelineState>(resolvePipeline(aDrawOptions)));
+		m_pipelines.back()->id = handle;
+
+		return handle;
+	}
+
+	const tPipelineState& Render::pipeline(tPipelineHandle aPipeline) const
+	{
+		if (aPipeline >= m_pipelines.size())
+			throw "invalid pipeline handle";
+
+		return *m_pipelines[aPipeline];
+	}
+
+	tPipelineState Render::resolvePipeline(const tDrawOptions& aDrawOptions)
+	{
+		tPipelineState ret;
+
+		ret.fov = aDrawOptions.m_fov.value_or(m_default_fov);
+		ret.color = aDrawOptions.m_wireframe ? aDrawOptions.m_color.value_or(0xDEADBEEF) : aDrawOptions.m_color.value_or(m_default_color);	//TODO: set default wireframe color
+		ret.pixelshader = aDrawOptions.m_pixelshader.value_or(funcPixelShader());
+		ret.wireframe = aDrawOptions.m_wireframe;
+		ret.rasterizer = aDrawOptions.m_rasterizer;
+		ret.cull = aDrawOptions.m_cull;
+		ret.depth = aDrawOptions.m_depth;
+		ret.transparent = aDrawOptions.m_transparent;
+		ret.id = numeric_limits<uint32_t>::max();
+
+		ret.screen_scale_x = m_width / ret.fov.near_plane.x();
+		ret.screen_scale_y = m_height / ret.fov.near_plane.y();
+		ret.inv_far = 1.0f / ret.fov.far_distance;
+		ret.frustum = tFrustum(ret.fov);
+
+		return ret;
 	}
 
-	void Render::impl_drawLine(const Vector4f& aVertice0, const Vector4f& aVertice1, uint32_t aColor)
+	void Render::impl_drawLine(const Vector4f& aVertice0, const Vector4f& aVertice1, uint32_t aColor, const tPipelineState& aPipeline, const tTarget& aTarget)
 	{
 		const float deltaX = fabs( aVertice1.x() - aVertice0.x() );
 		const float deltaY = fabs( aVertice1.y() - aVertice0.y() );
@@ -125,7 +379,7 @@ namespace SoftRender
 
 		//special case: line is only 1px
 		if (deltaX < 1.0f && deltaY < 1.0f) {
-			this->impl_setPixel(aVertice0, aColor);
+			this->impl_setPixel(aVertice0, aColor, aPipeline, aTarget);
 			return;
 		}
 
@@ -135,47 +389,50 @@ namespace SoftRender
 			if ((curr_delta * sign) < 0.0f)
 				break;
 
-			this->impl_setPixel(curr_vertice, aColor);
+			this->impl_setPixel(curr_vertice, aColor, aPipeline, aTarget);
 			curr_vertice += step;
 		}
 	}
 
 	void Render::impl_clear(uint32_t aColor, tRenderBuffer& aBuffer, bool aBackground)
 	{
-		m_buffers[m_buff_idx].is_cleared = false;
-
-		auto clear_func = [this, aColor, &aBuffer]() {
-			foreachPixel([&](uint32_t aX, uint32_t aY) {
-				aBuffer.color[getPixelIndex(aX, aY)] = aColor;
-				aBuffer.depth[getPixelIndex(aX, aY)] = 1.0f;
-				});
-			m_buffers[m_buff_idx].is_cleared = true;
-		};
-
-		if (aBackground) {
-			m_pool.add([clear_func]() {clear_func(); });
-		}
-		else {
-			clear_func();
+		//each band is cleared by the worker that rasterizes it, so with a
+		//pinned pool its rows are first touched and stay on that node
+		const int32_t band_count = m_pool.threadCount();
+		const int32_t band_height = bandHeight(band_count);
+		aBuffer.cleared.reset(band_count);
+		aBuffer.is_initialized = true;
+
+		for (int32_t iBand = 0; iBand < band_count; iBand++) {
+			m_pool.add_to(iBand, [this, aColor, &aBuffer, iBand, band_height]() {
+				const size_t first = std::min(static_cast<size_t>(iBand) * band_height, static_cast<size_t>(m_height)) * m_width;
+				const size_t end = std::min(static_cast<size_t>(iBand + 1) * band_height, static_cast<size_t>(m_height)) * m_width;
+				std::fill(aBuffer.color.begin() + first, aBuffer.color.begin() + end, aColor);
+				std::fill(aBuffer.depth.begin() + first, aBuffer.depth.begin() + end, 1.0f);
+				aBuffer.cleared.signal();
+			});
 		}
+
+		if (!aBackground)
+			aBuffer.cleared.wait();
 	}
 
-	void Render::impl_drawTriangleFilled(const Vector4f* aVertices, const tDrawOptions& aDrawOptions)
+	void Render::impl_drawTriangleFilled(const Vector4f* aVertices, uint32_t aColor, const tPipelineState& aPipeline, const tTarget& aTarget)
 	{
-		switch (aDrawOptions.m_rasterizer)
+		switch (aPipeline.rasterizer)
 		{
-		case eRasterizer::BARYCETIC:		return impl_drawTriangleFilled_barycentric(aVertices, aDrawOptions);
-		case eRasterizer::BRESEHAM_LIKE:	return impl_drawTriangleFilled_breseham_like(aVertices, aDrawOptions);
+		case eRasterizer::BARYCETIC:		return impl_drawTriangleFilled_barycentric(aVertices, aColor, aPipeline, aTarget);
+		case eRasterizer::BRESEHAM_LIKE:	return impl_drawTriangleFilled_breseham_like(aVertices, aColor, aPipeline, aTarget);
 		};
 	}
 
-	void Render::impl_drawTriangleFilled_barycentric(const Vector4f* aVertices, const tDrawOptions& aDrawOptions)
+	void Render::impl_drawTriangleFilled_barycentric(const Vector4f* aVertices, uint32_t aColor, const tPipelineState& aPipeline, const tTarget& aTarget)
 	{
 		const Vector3f vertices_3[] = { aVertices[0].head(3), aVertices[1].head(3), aVertices[2].head(3), };
 
 		const Vector3f d01 = (aVertices[1] - aVertices[0]).head(3);
 		const Vector3f d02 = (aVertices[2] - aVertices[0]).head(3);
-		uint32_t color = aDrawOptions.m_color.value_or(m_default_color);
+		const uint32_t color = aColor;
 
 		const float len01 = d01.head(2).norm();
 		const float len02 = d02.head(2).norm();
@@ -195,8 +452,8 @@ namespace SoftRender
 
 					uint32_t color_from_pixelshader = color;
 					
-					if (aDrawOptions.m_pixelshader.has_value()) {
-						color_from_pixelshader = aDrawOptions.m_pixelshader.value()(tPixelShaderData(color, result_normal, result_xy, m_width, m_height));
+					if (aPipeline.pixelshader) {
+						color_from_pixelshader = aPipeline.pixelshader(tPixelShaderData(color, result_normal, result_xy, m_width, m_height));
 					}
 
 					Vector4f tmp;
@@ -205,12 +462,12 @@ namespace SoftRender
 					tmp[2] = result[2];
 					tmp[3] = 0;
 
-					impl_setPixel(tmp, color_from_pixelshader);
+					impl_setPixel(tmp, color_from_pixelshader, aPipeline, aTarget);
 				}
 		}
 	}
 
-	void Render::impl_drawTriangleFilled_breseham_like(const Vector4f* aVertices, const tDrawOptions& aDrawOptions)
+	void Render::impl_drawTriangleFilled_breseham_like(const Vector4f* aVertices, uint32_t aColor, const tPipelineState& aPipeline, const tTarget& aTarget)
 	{
 		//sort 3 arrays indeces by left, middle, right | top, middle, bottom (depends on aAxis)
 		auto sorted_idx = [&aVertices](size_t aAxis) -> std::array<size_t, 3> {
@@ -282,7 +539,7 @@ namespace SoftRender
 
 			//for flatten triangle
 			if ( delta_y < 0.5f ) {
-				this->impl_drawLine(iHalfTri.p0, iHalfTri.p1, m_default_color);	//FIXME
+				this->impl_drawLine(iHalfTri.p0, iHalfTri.p1, m_default_color, aPipeline, aTarget);	//FIXME
 				continue;
 			}
 
@@ -293,13 +550,20 @@ namespace SoftRender
 
 			while ( (iHalfTri.p2[1]-curr_p0[1])*sign > 0.5f  ) {
 
-				uint32_t color = aDrawOptions.m_color.value_or(m_default_color);
+				//row outside of clip (e.g. other band)
+				if (curr_p0[1] < aTarget.clip.y0 || curr_p0[1] >= aTarget.clip.y1) {
+					curr_p0 += p0_delta;
+					curr_p1 += p1_delta;
+					continue;
+				}
+
+				uint32_t color = aColor;
 
-				if (aDrawOptions.m_pixelshader.has_value()) {
-					color = aDrawOptions.m_pixelshader.value()(tPixelShaderData(color, Vector3f(), Vector2f(), m_width, m_height)); //TODO: creater proper normal, pixelcoord
+				if (aPipeline.pixelshader) {
+					color = aPipeline.pixelshader(tPixelShaderData(color, Vector3f(), Vector2f(), m_width, m_height)); //TODO: creater proper normal, pixelcoord
 				}
 
-				this->impl_drawLine(curr_p0, curr_p1, color);
+				this->impl_drawLine(curr_p0, curr_p1, color, aPipeline, aTarget);
 				curr_p0 += p0_delta;
 				curr_p1 += p1_delta;
 			}
@@ -322,9 +586,12 @@ namespace SoftRender
 		//}
 	}
 
-	void Render::impl_setPixel(const Vector4f& aVertice, uint32_t aColor)
+	void Render::impl_setPixel(const Vector4f& aVertice, uint32_t aColor, const tPipelineState& aPipeline, const tTarget& aTarget)
 	{
-		if (aVertice.x() >= m_width || aVertice.x() < 0.0f || aVertice.y() >= m_height || aVertice.y() < 0.0f)
+		const tRect& clip = aTarget.clip;
+		tRenderBuffer& target = *aTarget.buffer;
+
+		if (aVertice.x() >= clip.x1 || aVertice.x() < clip.x0 || aVertice.y() >= clip.y1 || aVertice.y() < clip.y0)
 			return;
 
 		const auto depth = aVertice.z();
@@ -332,15 +599,36 @@ namespace SoftRender
 		const auto y = static_cast<size_t>(aVertice.y());
 		const auto idx = getPixelIndex(x, y);
 
+		//private target: one writer and only opaque TEST_WRITE pipelines
+		if (aTarget.exclusive) {
+			if (depth < target.depth[idx]) {
+				target.color[idx] = aColor;
+				target.depth[idx] = depth;
+				aTarget.exclusive->row_x0[y] = std::min(aTarget.exclusive->row_x0[y], static_cast<int32_t>(x));
+				aTarget.exclusive->row_x1[y] = std::max(aTarget.exclusive->row_x1[y], static_cast<int32_t>(x + 1));
+			}
+			return;
+		}
+
+		auto write_color = [&]() {
+			target.color[idx] = aPipeline.transparent ? blend(aColor, target.color[idx]) : aColor;
+		};
+
+		if (eDepthMode::DISABLED == aPipeline.depth) {
+			pixel_lock(target.mutex[idx], write_color);
+			return;
+		}
+
 		//prevent lock()
-		if (depth >= buff().depth[idx]) {
+		if (depth >= target.depth[idx]) {
 			return;
 		}
 
-		pixel_lock(buff().mutex[idx], [&]() {
-			if (depth <= buff().depth[idx]) {
-				buff().color[idx] = aColor;
-				buff().depth[idx] = depth;
+		pixel_lock(target.mutex[idx], [&]() {
+			if (depth <= target.depth[idx]) {
+				write_color();
+				if (eDepthMode::TEST_WRITE == aPipeline.depth)
+					target.depth[idx] = depth;
 			}
 		});
 	}
@@ -350,9 +638,14 @@ namespace SoftRender
 		return (m_width * aY + aX);
 	}
 
-	bool Render::projectPoint(Vector4f& aPoint, const tDrawOptions& aDrawOptions)
+	Render::tRect Render::screenRect() const
+	{
+		return { 0, 0, static_cast<int32_t>(m_width), static_cast<int32_t>(m_height) };
+	}
+
+	bool Render::projectPoint(Vector4f& aPoint, const tPipelineState& aPipeline)
 	{
-		const tFov& currFov = aDrawOptions.m_fov.value_or(m_default_fov);
+		const tFov& currFov = aPipeline.fov;
 
 		if (aPoint.z() < 0.0f)
 			return false;
@@ -373,11 +666,11 @@ namespace SoftRender
 		//if (abs(aPoint.y()) > (currFov.near_plane.y() / 2.0f))
 		//	return false;
 
-		aPoint.z() = (1.0f * aPoint.z()) / currFov.far_distance;
+		aPoint.z() = aPoint.z() * aPipeline.inv_far;
 
 		//fit to screen
-		aPoint.x() *= m_width / currFov.near_plane.x();
-		aPoint.y() *= m_height / currFov.near_plane.y();
+		aPoint.x() *= aPipeline.screen_scale_x;
+		aPoint.y() *= aPipeline.screen_scale_y;
 
 		//to center of the sceen
 		aPoint.x() += m_width / 2.0f;
@@ -403,10 +696,21 @@ namespace SoftRender
 
 	void* Render::getBuffer()
 	{
+		if (m_pipelined) {
+			//latest completed frame
+			if (m_front_idx >= m_buffers.size())
+				return reinterpret_cast<void*>(buff().color.data());
+
+			m_inflight.stages.graph.wait();
+			return reinterpret_cast<void*>(m_buffers[m_front_idx].color.data());
+		}
+
+		flush();
+
 		return reinterpret_cast<void*>(buff().color.data());
 	}
 
-	void Render::drawTriangle(vector<Vector4f> aVertices, const tDrawOptions& aDrawOptions)
+	void Render::drawTriangle(const vector<Vector4f>& aVertices, const tDrawOptions& aDrawOptions)
 	{
 		if (3 != aVertices.size())
 			throw "there should be 3 vertices given to drawTriangle";
@@ -414,33 +718,830 @@ namespace SoftRender
 		drawTriangle(aVertices.data(), aDrawOptions);
 	}
 
-	void Render::drawTriangle(array<Vector4f, 3> aVertices, const tDrawOptions& aDrawOptions)
+	void Render::drawTriangle(const array<Vector4f, 3>& aVertices, const tDrawOptions& aDrawOptions)
 	{
-		if (3 != aVertices.size())
-			throw "there should be 3 vertices given to drawTriangle";
-
 		drawTriangle(aVertices.data(), aDrawOptions);
 	}
 
-	void Render::drawTriangle(Vector4f* aVertices, const tDrawOptions& aDrawOptions)
+	void Render::drawTriangle(const Vector4f* aVertices, const tDrawOptions& aDrawOptions)
+	{
+		if (m_deferred) {
+			//the queued triangle needs a pipeline that lives until flush(); a run
+			//of triangles with equal options (one legacy draw call) shares it
+			scoped_lock lck(m_queue_mutex);
+			if (!m_frame_options || !same_options(*m_frame_options, aDrawOptions)) {
+				m_frame_pipelines.push_back(resolvePipeline(aDrawOptions));
+				m_frame_options = aDrawOptions;
+			}
+			impl_enqueueTriangle(aVertices, m_frame_pipelines.back());
+			return;
+		}
+
+		impl_drawTriangle(aVertices, resolvePipeline(aDrawOptions));
+	}
+
+	void Render::drawTriangle(const array<Vector4f, 3>& aVertices, tPipelineHandle aPipeline)
+	{
+		drawTriangle(aVertices.data(), aPipeline);
+	}
+
+	void Render::drawTriangle(const Vector4f* aVertices, tPipelineHandle aPipeline)
+	{
+		if (m_deferred) {
+			tSetupTriangle setup;
+			if (impl_setupTriangle(aVertices, pipeline(aPipeline), setup)) {
+				scoped_lock lck(m_queue_mutex);
+				m_queue.push_back(setup);
+			}
+			return;
+		}
+
+		impl_drawTriangle(aVertices, pipeline(aPipeline));
+	}
+
+	void Render::setDeferred(bool aDeferred)
+	{
+		if (!aDeferred)
+			setPipelined(false);
+
+		flush();
+		m_deferred = aDeferred;
+	}
+
+	void Render::flush()
+	{
+		//the pipelined frame shares the private targets and the controller
+		m_inflight.stages.graph.wait();
+
+		if (m_queue.empty())
+			return;
+
+		impl_runStages(m_queue, true, m_stages, buff());
+		m_stages.graph.wait();
+
+		m_queue.clear();
+		m_frame_pipelines.clear();
+		m_frame_options.reset();
+	}
+
+	void Render::impl_sortSetups(vector<tSetupTriangle>& aSetups, vector<tSetupTriangle>& aScratch)
+	{
+		//opaque: front to back by key; transparent: after opaque, submission order
+		auto less = [](const tSetupTriangle& aLeft, const tSetupTriangle& aRight) {
+			if (aLeft.pipeline->transparent != aRight.pipeline->transparent)
+				return aRight.pipeline->transparent;
+			if (aLeft.pipeline->transparent)
+				return false;
+			return aLeft.sort_key < aRight.sort_key;
+		};
+
+		//stable merge sort through a reused buffer: std::stable_sort
+		//allocates its temporary buffer on every call
+		constexpr size_t RUN = 16;
+		const size_t count = aSetups.size();
+		const auto queue = aSetups.begin();
+
+		for (size_t iRun = 0; iRun < count; iRun += RUN) {
+			const size_t end = std::min(iRun + RUN, count);
+			for (size_t iSetup = iRun + 1; iSetup < end; iSetup++) {
+				std::rotate(std::upper_bound(queue + iRun, queue + iSetup, aSetups[iSetup], less), queue + iSetup, queue + iSetup + 1);
+			}
+		}
+
+		aScratch.resize(count);
+		for (size_t iWidth = RUN; iWidth < count; iWidth *= 2) {
+			for (size_t iLeft = 0; iLeft < count; iLeft += 2 * iWidth) {
+				const size_t mid = std::min(iLeft + iWidth, count);
+				const size_t end = std::min(iLeft + 2 * iWidth, count);
+				std::merge(aSetups.begin() + iLeft, aSetups.begin() + mid, aSetups.begin() + mid, aSetups.begin() + end, aScratch.begin() + iLeft, less);
+			}
+			std::swap(aSetups, aScratch);
+		}
+	}
+
+	void Render::impl_enqueueTriangle(const Vector4f* aVertices, const tPipelineState& aPipeline)
+	{
+		tSetupTriangle setup;
+		if (impl_setupTriangle(aVertices, aPipeline, setup))
+			m_queue.push_back(setup);
+	}
+
+	void Render::submit(const CommandList& aList)
+	{
+		const CommandList* list = &aList;
+		impl_submit(&list, 1);
+	}
+
+	void Render::submit(const vector<const CommandList*>& aLists)
+	{
+		impl_submit(aLists.data(), aLists.size());
+	}
+
+	void Render::impl_submit(const CommandList* const* aLists, size_t aCount)
+	{
+		size_t count = 0;
+		for (size_t iList = 0; iList < aCount; iList++) {
+			count += aLists[iList]->size();
+		}
+
+		m_submit_setups.resize(count);
+
+		//setup: projection and culling, chunked over all commands
+		size_t first = 0;
+		for (size_t iList = 0; iList < aCount; iList++) {
+			const CommandList* list = aLists[iList];
+			m_pool.parallel_for(0, list->size(), 64, [this, list, first](size_t aBegin, size_t aEnd) {
+				for (size_t iCmd = aBegin; iCmd < aEnd; iCmd++) {
+					const auto& cmd = list->m_commands[iCmd];
+					impl_setupTriangle(cmd.vertices.data(), pipeline(cmd.pipeline), m_submit_setups[first + iCmd]);
+				}
+			});
+
+			first += list->size();
+		}
+
+		impl_executeSetups(m_submit_setups);
+	}
+
+	void Render::drawInstanced(const tMesh& aMesh, const vector<Matrix4f>& aTransforms, const vector<uint32_t>& aColors, tPipelineHandle aPipeline)
+	{
+		if (!aColors.empty() && aColors.size() != aTransforms.size())
+			throw "there should be one color per instance given to drawInstanced";
+
+		drawInstanced(aMesh, aTransforms.data(), aColors.empty() ? nullptr : aColors.data(), aTransforms.size(), aPipeline);
+	}
+
+	void Render::drawMesh(const tMesh& aMesh, const Matrix4f& aTransform, tPipelineHandle aPipeline)
+	{
+		drawInstanced(aMesh, &aTransform, nullptr, 1, aPipeline);
+	}
+
+	void Render::drawInstanced(const tMesh& aMesh, const Matrix4f* aTransforms, const uint32_t* aColors, size_t aCount, tPipelineHandle aPipeline)
+	{
+		const tPipelineState& state = pipeline(aPipeline);
+
+		m_instances.resize(aCount);
+		for (size_t iInstance = 0; iInstance < aCount; iInstance++) {
+			tInstance& instance = m_instances[iInstance];
+			instance.mesh = &aMesh;
+			instance.transform = aTransforms[iInstance];
+			instance.pipeline = &state;
+			instance.has_color = nullptr != aColors;
+			instance.color = aColors ? aColors[iInstance] : 0;
+		}
+
+		impl_drawInstances();
+	}
+
+	void Render::drawInstanced(const tMeshLod& aLod, const Matrix4f* aTransforms, const uint32_t* aColors, size_t aCount, tPipelineHandle aPipeline)
+	{
+		const tPipelineState& state = pipeline(aPipeline);
+
+		m_instances.resize(aCount);
+		for (size_t iInstance = 0; iInstance < aCount; iInstance++) {
+			tInstance& instance = m_instances[iInstance];
+			instance.mesh = &aLod.levels[selectLod(aLod, aTransforms[iInstance], aPipeline)];
+			instance.transform = aTransforms[iInstance];
+			instance.pipeline = &state;
+			instance.has_color = nullptr != aColors;
+			instance.color = aColors ? aColors[iInstance] : 0;
+		}
+
+		impl_drawInstances();
+	}
+
+	void Render::drawIndexed(const void* aVertices, const tVertexLayout& aLayout, const uint32_t* aIndices, size_t aIndexCount, const Matrix4f& aTransform, tPipelineHandle aPipeline)
+	{
+		const tPipelineState& state = pipeline(aPipeline);
+		const size_t triangle_count = aIndexCount / 3;
+
+		m_submit_setups.resize(triangle_count);
+
+		m_pool.parallel_for(0, triangle_count, 256, [this, aVertices, &aLayout, aIndices, &aTransform, &state](size_t aBegin, size_t aEnd) {
+			//small direct mapped post transform cache: shared vertices
+			//of neighbouring triangles are fetched and transformed once
+			constexpr uint32_t CACHE_SIZE = 32;
+			uint32_t cache_idx[CACHE_SIZE];
+			Vector4f cache_vertex[CACHE_SIZE];
+			std::fill(std::begin(cache_idx), std::end(cache_idx), numeric_limits<uint32_t>::max());
+
+			for (size_t iTriangle = aBegin; iTriangle < aEnd; iTriangle++) {
+				const uint32_t* idx = &aIndices[iTriangle * 3];
+				Vector4f vertices[3];
+
+				for (size_t iVertex = 0; iVertex < 3; iVertex++) {
+					const uint32_t slot = idx[iVertex] % CACHE_SIZE;
+					if (cache_idx[slot] != idx[iVertex]) {
+						cache_idx[slot] = idx[iVertex];
+						cache_vertex[slot] = aTransform * aLayout.fetchPosition(aVertices, idx[iVertex]);
+					}
+					vertices[iVertex] = cache_vertex[slot];
+				}
+
+				tSetupTriangle& setup = m_submit_setups[iTriangle];
+				if (impl_setupTriangle(vertices, state, setup) && aLayout.m_color_offset)
+					setup.color = aLayout.fetchColor(aVertices, idx[0]);
+			}
+		});
+
+		impl_executeSetups(m_submit_setups);
+	}
+
+	size_t Render::selectLod(const tMeshLod& aLod, const Matrix4f& aTransform, tPipelineHandle aPipeline) const
 	{
-		Vector4f vertices[] = { aVertices[0], aVertices[1], aVertices[2] };
+		if (aLod.levels.empty())
+			throw "tMeshLod without levels";
+
+		return aLod.select(screenDiameter(aLod.levels[0].bounds, aTransform, aPipeline));
+	}
+
+	float Render::screenDiameter(const tBounds& aBounds, const Matrix4f& aTransform, tPipelineHandle aPipeline) const
+	{
+		const tPipelineState& state = pipeline(aPipeline);
+
+		Vector3f center;
+		float radius;
+		aBounds.transformSphere(aTransform, center, radius);
+
+		//camera inside the sphere
+		if (center.z() <= radius)
+			return numeric_limits<float>::max();
+
+		const float scale = std::max(state.screen_scale_x, state.screen_scale_y);
+		return 2.0f * radius * (state.fov.near_distance / center.z()) * scale;
+	}
+
+	void Render::impl_drawInstances()
+	{
+		size_t setup_count = 0;
+		for (tInstance& iInstance : m_instances) {
+			iInstance.first_setup = setup_count;
+			setup_count += iInstance.mesh->triangleCount();
+		}
+
+		m_submit_setups.resize(setup_count);
+
+		//setup: every instance transforms its shared vertices once
+		const size_t count = m_instances.size();
+		m_pool.parallel_for(0, count, 4, [this](size_t aBegin, size_t aEnd) {
+			for (size_t iInstance = aBegin; iInstance < aEnd; iInstance++) {
+				const tInstance& instance = m_instances[iInstance];
+				const tMesh& mesh = *instance.mesh;
+				const tPipelineState& state = *instance.pipeline;
+				const size_t triangle_count = mesh.triangleCount();
+				const bool has_triangle_colors = mesh.triangle_colors.size() == triangle_count;
+				tSetupTriangle* setups = &m_submit_setups[instance.first_setup];
+
+				//reject whole instance before any vertex work
+				Vector3f center;
+				float radius;
+				mesh.bounds.transformSphere(instance.transform, center, radius);
+				if (!state.frustum.intersects_sphere(center, radius)) {
+					for (size_t iTriangle = 0; iTriangle < triangle_count; iTriangle++) {
+						setups[iTriangle].is_valid = false;
+					}
+					continue;
+				}
+
+				ArenaScope scope;
+				Vector4f* world = scope.allocate<Vector4f>(mesh.positions.size());
+				for (size_t iVertex = 0; iVertex < mesh.positions.size(); iVertex++) {
+					world[iVertex] = instance.transform * mesh.positions[iVertex];
+				}
+
+				for (size_t iTriangle = 0; iTriangle < triangle_count; iTriangle++) {
+					const uint32_t* idx = &mesh.indices[iTriangle * 3];
+					const Vector4f vertices[] = { world[idx[0]], world[idx[1]], world[idx[2]] };
+
+					tSetupTriangle& setup = setups[iTriangle];
+					if (!impl_setupTriangle(vertices, state, setup))
+						continue;
+
+					if (instance.has_color)
+						setup.color = instance.color;
+					else if (has_triangle_colors)
+						setup.color = mesh.triangle_colors[iTriangle];
+				}
+			}
+		});
+
+		impl_executeSetups(m_submit_setups);
+	}
+
+	void Render::drawScene(const StaticScene& aScene, const Matrix4f& aView, tPipelineHandle aCamera, const OcclusionBuffer* aOcclusion)
+	{
+		aScene.query(pipeline(aCamera).frustum.transformed(aView), m_scene_visible, aOcclusion);
+
+		m_instances.resize(m_scene_visible.size());
+		for (size_t iVisible = 0; iVisible < m_scene_visible.size(); iVisible++) {
+			const StaticScene::tObject& object = aScene.object(m_scene_visible[iVisible]);
+
+			tInstance& instance = m_instances[iVisible];
+			instance.mesh = object.mesh;
+			instance.transform = aView * object.transform;
+			instance.pipeline = &pipeline(object.pipeline);
+			instance.has_color = false;
+			instance.color = 0;
+		}
+
+		impl_drawInstances();
+	}
+
+	void Render::drawStatic(const StaticGeometry& aGeometry, const Matrix4f& aView, tPipelineHandle aCamera)
+	{
+		const tFrustum frustum = pipeline(aCamera).frustum.transformed(aView);
+		const Vector3f camera = aView.inverse().block<3, 1>(0, 3);
+
+		m_scene_visible.clear();
+		m_cluster_first_setup.clear();
+
+		size_t setup_count = 0;
+		for (uint32_t iCluster = 0; iCluster < aGeometry.clusterCount(); iCluster++) {
+			const StaticGeometry::tCluster& cluster = aGeometry.cluster(iCluster);
+
+			if (!frustum.intersects_sphere(cluster.bounds.center, cluster.bounds.radius))
+				continue;
+			if (eCullMode::BACK == pipeline(cluster.pipeline).cull && cluster.bounds.is_backfacing(camera))
+				continue;
+
+			m_scene_visible.push_back(iCluster);
+			m_cluster_first_setup.push_back(setup_count);
+			setup_count += cluster.triangle_count;
+		}
+
+		m_submit_setups.resize(setup_count);
+
+		//setup: only the view is applied, the vertices are already in world space
+		const size_t count = m_scene_visible.size();
+		m_pool.parallel_for(0, count, 4, [this, &aGeometry, &aView](size_t aBegin, size_t aEnd) {
+			for (size_t iVisible = aBegin; iVisible < aEnd; iVisible++) {
+				const StaticGeometry::tCluster& cluster = aGeometry.cluster(m_scene_visible[iVisible]);
+				const tPipelineState& state = pipeline(cluster.pipeline);
+				tSetupTriangle* setups = &m_submit_setups[m_cluster_first_setup[iVisible]];
+
+				ArenaScope scope;
+				Vector4f* view = scope.allocate<Vector4f>(cluster.vertex_count);
+				for (uint32_t iVertex = 0; iVertex < cluster.vertex_count; iVertex++) {
+					view[iVertex] = aView * aGeometry.positions[cluster.first_vertex + iVertex];
+				}
+
+				for (uint32_t iTriangle = 0; iTriangle < cluster.triangle_count; iTriangle++) {
+					const uint32_t triangle = cluster.first_triangle + iTriangle;
+					const uint8_t* idx = &aGeometry.indices[triangle * 3];
+					const Vector4f vertices[] = { view[idx[0]], view[idx[1]], view[idx[2]] };
+
+					if (impl_setupTriangle(vertices, state, setups[iTriangle]) && aGeometry.has_color[triangle])
+						setups[iTriangle].color = aGeometry.colors[triangle];
+				}
+			}
+		});
+
+		impl_executeSetups(m_submit_setups);
+	}
+
+	void Render::drawMeshlets(const tMesh& aMesh, const tMeshlets& aMeshlets, const Matrix4f& aTransform, tPipelineHandle aPipeline, const OcclusionBuffer* aOcclusion)
+	{
+		const tPipelineState& state = pipeline(aPipeline);
+		const Vector3f camera = aTransform.inverse().block<3, 1>(0, 3);	//mesh space
+
+		m_scene_visible.clear();
+		m_cluster_first_setup.clear();
+
+		size_t setup_count = 0;
+		for (uint32_t iMeshlet = 0; iMeshlet < aMeshlets.meshlets.size(); iMeshlet++) {
+			const tMeshlet& meshlet = aMeshlets.meshlets[iMeshlet];
+
+			if (eCullMode::BACK == state.cull && meshlet.bounds.is_backfacing(camera))
+				continue;
+
+			tBounds sphere;
+			sphere.center = meshlet.bounds.center;
+			sphere.radius = meshlet.bounds.radius;
+
+			Vector3f center;
+			float radius;
+			sphere.transformSphere(aTransform, center, radius);
+
+			if (!state.frustum.intersects_sphere(center, radius))
+				continue;
+			if (aOcclusion && !aOcclusion->isVisibleSphere(center, radius))
+				continue;
+
+			m_scene_visible.push_back(iMeshlet);
+			m_cluster_first_setup.push_back(setup_count);
+			setup_count += meshlet.triangle_count;
+		}
+
+		m_submit_setups.resize(setup_count);
+
+		const bool has_triangle_colors = aMesh.triangle_colors.size() == aMesh.triangleCount();
+		const size_t count = m_scene_visible.size();
+		m_pool.parallel_for(0, count, 4, [this, &aMesh, &aMeshlets, &aTransform, &state, has_triangle_colors](size_t aBegin, size_t aEnd) {
+			for (size_t iVisible = aBegin; iVisible < aEnd; iVisible++) {
+				const tMeshlet& meshlet = aMeshlets.meshlets[m_scene_visible[iVisible]];
+				tSetupTriangle* setups = &m_submit_setups[m_cluster_first_setup[iVisible]];
+
+				ArenaScope scope;
+				Vector4f* view = scope.allocate<Vector4f>(meshlet.vertex_count);
+				for (uint32_t iVertex = 0; iVertex < meshlet.vertex_count; iVertex++) {
+					view[iVertex] = aTransform * aMesh.positions[aMeshlets.vertices[meshlet.first_vertex + iVertex]];
+				}
+
+				for (uint32_t iTriangle = 0; iTriangle < meshlet.triangle_count; iTriangle++) {
+					const uint32_t triangle = meshlet.first_triangle + iTriangle;
+					const uint8_t* idx = &aMeshlets.indices[triangle * 3];
+					const Vector4f vertices[] = { view[idx[0]], view[idx[1]], view[idx[2]] };
+
+					if (impl_setupTriangle(vertices, state, setups[iTriangle]) && has_triangle_colors)
+						setups[iTriangle].color = aMesh.triangle_colors[aMeshlets.triangles[triangle]];
+				}
+			}
+		});
+
+		impl_executeSetups(m_submit_setups);
+	}
+
+	bool Render::isVisible(const tBounds& aBounds, const Matrix4f& aTransform, tPipelineHandle aPipeline) const
+	{
+		Vector3f center;
+		float radius;
+		aBounds.transformSphere(aTransform, center, radius);
+
+		return pipeline(aPipeline).frustum.intersects_sphere(center, radius);
+	}
+
+	void Render::impl_executeSetups(vector<tSetupTriangle>& aSetups)
+	{
+		if (m_deferred) {
+			scoped_lock lck(m_queue_mutex);
+			for (const tSetupTriangle& iSetup : aSetups) {
+				if (iSetup.is_valid)
+					m_queue.push_back(iSetup);
+			}
+			return;
+		}
+
+		impl_rasterBands(aSetups);
+	}
+
+	void Render::impl_rasterBands(vector<tSetupTriangle>& aSetups)
+	{
+		impl_runStages(aSetups, false, m_stages, buff());
+		m_stages.graph.wait();
+	}
+
+	Executor& Render::impl_beginStages(size_t aTriangleCount, tStages& aStages)
+	{
+		double pixels_per_triangle;
+		{
+			scoped_lock lck(m_stats_mutex);
+			pixels_per_triangle = m_pixels_per_triangle;
+		}
+
+		//small batches are cheaper on this thread than handed around
+		const double work = aTriangleCount * (TRIANGLE_WORK + pixels_per_triangle);
+		const int32_t workers = m_controller.choose(work);
+
+		//the bands stay at pool width, so a band is always cleared and drawn
+		//by the same worker; fewer workers just take several bands each
+		aStages.workers = workers;
+		aStages.band_count = m_pool.threadCount();
+		aStages.band_height = bandHeight(aStages.band_count);
+		aStages.triangles = aTriangleCount;
+		aStages.pixels = 0;
+		aStages.start = chrono::steady_clock::now();
+
+		return workers > 1 ? m_pool : static_cast<Executor&>(m_inline);
+	}
+
+	void Render::impl_endStages(const tStages& aStages)
+	{
+		const double seconds = chrono::duration<double>(chrono::steady_clock::now() - aStages.start).count();
+		const size_t pixels = aStages.pixels;
+
+		//the measured work, not the estimate the choice was based on
+		m_controller.report(aStages.workers, aStages.triangles * TRIANGLE_WORK + pixels, seconds);
+
+		scoped_lock lck(m_stats_mutex);
+		m_frame_stats.batches++;
+		m_frame_stats.triangles += aStages.triangles;
+		m_frame_stats.pixels += pixels;
+		m_frame_stats.raster_seconds += seconds;
+		m_frame_stats.workers = aStages.workers;
+
+		if (aStages.triangles > 0)
+			m_pixels_per_triangle = 0.9 * m_pixels_per_triangle + 0.1 * (static_cast<double>(pixels) / aStages.triangles);
+	}
+
+	void Render::impl_runStages(vector<tSetupTriangle>& aSetups, bool aSort, tStages& aStages, tRenderBuffer& aBuffer)
+	{
+		//asynchronous: aStages.graph is done once all bands are rasterized.
+		//Every job starts as soon as its inputs are ready: a band does not
+		//wait for other bands, only for the bins it reads
+		JobGraph& graph = aStages.graph;
+		graph.clear();
+
+		Executor& executor = impl_beginStages(aSetups.size(), aStages);
+		const int32_t workers = aStages.workers;
+
+		//sized for the widest batch, so a worker count the controller has
+		//not tried yet does not grow the graph in the middle of a frame
+		const size_t band_count = aStages.band_count;
+		graph.reserve(2 * band_count + 2, band_count * band_count + 2 * band_count);
+
+		tJob sort = 0;
+		if (aSort) {
+			sort = graph.add([this, &aSetups, &aStages]() {
+				impl_sortSetups(aSetups, aStages.sort_scratch);
+			});
+		}
+
+		//a single worker has no lock contention to avoid
+		if (eRasterMode::PRIVATE_TARGETS == m_raster_mode && workers > 1 && impl_isCompositable(aSetups)) {
+			impl_addPrivateStages(aSetups, aSort ? &sort : nullptr, aStages, aBuffer);
+		}
+		else {
+			impl_addBandStages(aSetups, aSort ? &sort : nullptr, aStages, aBuffer);
+		}
+		const tJob end_raster = static_cast<tJob>(graph.size());
+
+		const tJob done = graph.add([this, &aStages]() {
+			impl_endStages(aStages);
+		});
+		for (tJob iJob = end_raster - workers; iJob < end_raster; iJob++) {
+			graph.depend(done, iJob);
+		}
+
+		graph.run(executor);
+	}
+
+	void Render::impl_addBandStages(vector<tSetupTriangle>& aSetups, const tJob* aSort, tStages& aStages, tRenderBuffer& aBuffer)
+	{
+		//bin chunks -> one raster job per worker
+		JobGraph& graph = aStages.graph;
+		const int32_t workers = aStages.workers;
+		const int32_t band_count = aStages.band_count;
+		const size_t chunk_count = std::clamp(aSetups.size() / BIN_CHUNK_SIZE, size_t(1), static_cast<size_t>(band_count));
+		aStages.chunk_count = chunk_count;
+
+		//never shrinks: the bins keep their capacity between batches
+		if (aStages.bins.size() < chunk_count * band_count)
+			aStages.bins.resize(chunk_count * band_count);
+
+		const tJob first_bin = static_cast<tJob>(graph.size());
+		for (size_t iChunk = 0; iChunk < chunk_count; iChunk++) {
+			const tJob bin = graph.add([this, &aSetups, &aStages, iChunk]() {
+				const size_t count = aSetups.size();
+				const size_t chunk_count = aStages.chunk_count;
+				impl_binChunk(aSetups, count * iChunk / chunk_count, count * (iChunk + 1) / chunk_count, aStages, &aStages.bins[iChunk * aStages.band_count]);
+			});
+
+			if (aSort)
+				graph.depend(bin, *aSort);
+		}
+
+		//a run of bands goes to the worker owning its first band, so at full
+		//width band N is always drawn by worker N that cleared it
+		for (int32_t iWorker = 0; iWorker < workers; iWorker++) {
+			const int32_t first_band = band_count * iWorker / workers;
+			const int32_t end_band = band_count * (iWorker + 1) / workers;
+			const tJob raster = graph.add([this, &aSetups, &aStages, first_band, end_band, &aBuffer]() {
+				for (int32_t iBand = first_band; iBand < end_band; iBand++) {
+					impl_rasterBand(aSetups, aStages, iBand, aBuffer);
+				}
+			}, first_band);
+
+			for (size_t iChunk = 0; iChunk < chunk_count; iChunk++) {
+				graph.depend(raster, first_bin + static_cast<tJob>(iChunk));
+			}
+		}
+	}
+
+	void Render::impl_rasterBand(const vector<tSetupTriangle>& aSetups, const tStages& aStages, int32_t aBand, tRenderBuffer& aBuffer)
+	{
+		//every band owns its rows: no two threads touch the same pixel
+		//and each band sees its triangles in submission order
+		tTarget target = { &aBuffer, screenRect() };
+		target.clip.y0 = std::min(aBand * aStages.band_height, target.clip.y1);
+		target.clip.y1 = std::min(target.clip.y0 + aStages.band_height, target.clip.y1);
+
+		//chunks in order, so the submission order holds across them
+		for (size_t iChunk = 0; iChunk < aStages.chunk_count; iChunk++) {
+			for (uint32_t iSetup : aStages.bins[iChunk * aStages.band_count + aBand]) {
+				impl_rasterTriangle(aSetups[iSetup], target);
+			}
+		}
+	}
+
+	int32_t Render::bandHeight(int32_t aBandCount) const
+	{
+		return (static_cast<int32_t>(m_height) + aBandCount - 1) / aBandCount;
+	}
+
+	size_t Render::impl_boundsArea(const tSetupTriangle& aSetup)
+	{
+		//a triangle covers about half of its bounds
+		return static_cast<size_t>(aSetup.bounds.x1 - aSetup.bounds.x0) * static_cast<size_t>(aSetup.bounds.y1 - aSetup.bounds.y0) / 2;
+	}
+
+	void Render::impl_binChunk(const vector<tSetupTriangle>& aSetups, size_t aFirst, size_t aEnd, tStages& aStages, vector<uint32_t>* aBins)
+	{
+		const int32_t band_height = aStages.band_height;
+
+		for (int32_t iBand = 0; iBand < aStages.band_count; iBand++) {
+			aBins[iBand].clear();
+		}
+
+		size_t pixels = 0;
+		for (size_t iSetup = aFirst; iSetup < aEnd; iSetup++) {
+			const tSetupTriangle& setup = aSetups[iSetup];
+			if (!setup.is_valid)
+				continue;
+
+			pixels += impl_boundsArea(setup);
+
+			const int32_t first_band = setup.bounds.y0 / band_height;
+			const int32_t last_band = (setup.bounds.y1 - 1) / band_height;
+			for (int32_t iBand = first_band; iBand <= last_band; iBand++) {
+				aBins[iBand].push_back(static_cast<uint32_t>(iSetup));
+			}
+		}
+
+		aStages.pixels += pixels;
+	}
+
+	bool Render::impl_isCompositable(const vector<tSetupTriangle>& aSetups) const
+	{
+		//a depth merge can neither blend nor skip the depth write
+		return std::all_of(aSetups.begin(), aSetups.end(), [](const tSetupTriangle& aSetup) {
+			return !aSetup.is_valid || (!aSetup.pipeline->transparent && eDepthMode::TEST_WRITE == aSetup.pipeline->depth);
+		});
+	}
+
+	void Render::impl_addPrivateStages(vector<tSetupTriangle>& aSetups, const tJob* aSort, tStages& aStages, tRenderBuffer& aBuffer)
+	{
+		//each worker draws a contiguous share into its own target ->
+		//each band merges its rows of all targets, on the worker owning it
+		JobGraph& graph = aStages.graph;
+		const int32_t worker_count = aStages.workers;
+		const int32_t band_count = aStages.band_count;
+		while (m_private_targets.size() < static_cast<size_t>(worker_count)) {
+			m_private_targets.push_back(make_unique<tPrivateTarget>());
+		}
+
+		const tJob first_raster = static_cast<tJob>(graph.size());
+		for (int32_t iWorker = 0; iWorker < worker_count; iWorker++) {
+			const tJob raster = graph.add([this, &aSetups, &aStages, iWorker, worker_count]() {
+				const size_t count = aSetups.size();
+				impl_rasterPrivate(aSetups, count * iWorker / worker_count, count * (iWorker + 1) / worker_count, aStages, *m_private_targets[iWorker]);
+			}, iWorker);
+
+			if (aSort)
+				graph.depend(raster, *aSort);
+		}
+
+		//merged in runs of bands like the band raster
+		for (int32_t iWorker = 0; iWorker < worker_count; iWorker++) {
+			const int32_t first_band = band_count * iWorker / worker_count;
+			const int32_t end_band = band_count * (iWorker + 1) / worker_count;
+			const tJob merge = graph.add([this, first_band, end_band, &aStages, &aBuffer]() {
+				for (int32_t iBand = first_band; iBand < end_band; iBand++) {
+					impl_mergeBand(iBand, aStages, aBuffer);
+				}
+			}, first_band);
+
+			for (int32_t iRaster = 0; iRaster < worker_count; iRaster++) {
+				graph.depend(merge, first_raster + iRaster);
+			}
+		}
+	}
+
+	void Render::impl_rasterPrivate(const vector<tSetupTriangle>& aSetups, size_t aFirst, size_t aEnd, tStages& aStages, tPrivateTarget& aTarget)
+	{
+		//first touched by the worker that draws into it
+		if (!aTarget.is_initialized) {
+			aTarget.buffer.color.resize(pixelCount());
+			aTarget.buffer.depth.assign(pixelCount(), numeric_limits<float>::infinity());
+			aTarget.buffer.mutex = nullptr;
+			aTarget.row_x0.assign(m_height, static_cast<int32_t>(m_width));
+			aTarget.row_x1.assign(m_height, 0);
+			aTarget.is_initialized = true;
+		}
+
+		size_t pixels = 0;
+		const tTarget target = { &aTarget.buffer, screenRect(), &aTarget };
+		for (size_t iSetup = aFirst; iSetup < aEnd; iSetup++) {
+			if (!aSetups[iSetup].is_valid)
+				continue;
+
+			pixels += impl_boundsArea(aSetups[iSetup]);
+			impl_rasterTriangle(aSetups[iSetup], target);
+		}
+
+		aStages.pixels += pixels;
+	}
+
+	void Render::impl_mergeBand(int32_t aBand, const tStages& aStages, tRenderBuffer& aBuffer)
+	{
+		const int32_t y0 = std::min(aBand * aStages.band_height, static_cast<int32_t>(m_height));
+		const int32_t y1 = std::min(y0 + aStages.band_height, static_cast<int32_t>(m_height));
+
+		//in submission order, so on equal depth the earlier share wins
+		for (auto& iTarget : m_private_targets) {
+			tPrivateTarget& target = *iTarget;
+			if (!target.is_initialized)
+				continue;
+
+			for (int32_t iRow = y0; iRow < y1; iRow++) {
+				const int32_t x0 = target.row_x0[iRow];
+				const int32_t x1 = target.row_x1[iRow];
+				if (x0 >= x1)
+					continue;
+
+				//lazy clear: only the drawn span goes back to infinite depth
+				const size_t first = getPixelIndex(x0, iRow);
+				composite_min_depth(&target.buffer.color[first], &target.buffer.depth[first], &aBuffer.color[first], &aBuffer.depth[first], x1 - x0);
+				std::fill(target.buffer.depth.begin() + first, target.buffer.depth.begin() + first + (x1 - x0), numeric_limits<float>::infinity());
+
+				target.row_x0[iRow] = static_cast<int32_t>(m_width);
+				target.row_x1[iRow] = 0;
+			}
+		}
+	}
+
+	void Render::impl_drawTriangle(const Vector4f* aVertices, const tPipelineState& aPipeline)
+	{
+		tSetupTriangle setup;
+
+		if (impl_setupTriangle(aVertices, aPipeline, setup))
+			impl_rasterTriangle(setup, { &buff(), screenRect() });
+	}
+
+	bool Render::impl_setupTriangle(const Vector4f* aVertices, const tPipelineState& aPipeline, tSetupTriangle& aSetup)
+	{
+		aSetup.is_valid = false;
+		aSetup.pipeline = &aPipeline;
+		aSetup.color = aPipeline.color;
+
+		auto& vertices = aSetup.vertices;
+		vertices = { aVertices[0], aVertices[1], aVertices[2] };
 
 		for (Vector4f& iPoint : vertices) {
-			if (!projectPoint(iPoint, aDrawOptions)) {
-				return;
+			if (!projectPoint(iPoint, aPipeline)) {
+				return false;
 			}
 		}
 
-		if (aDrawOptions.m_wireframe) {
-			const uint32_t color = aDrawOptions.m_color.value_or(0xDEADBEEF);	//TODO: set default color if not avail
-		
-			impl_drawLine(vertices[0], vertices[1], color);
-			impl_drawLine(vertices[1], vertices[2], color);
-			impl_drawLine(vertices[2], vertices[0], color);
+		if (eCullMode::NONE != aPipeline.cull) {
+			//> 0: cross(v1-v0, v2-v0) points away from the camera
+			const float area = (vertices[1].x() - vertices[0].x()) * (vertices[2].y() - vertices[0].y())
+				- (vertices[2].x() - vertices[0].x()) * (vertices[1].y() - vertices[0].y());
+
+			if (eCullMode::BACK == aPipeline.cull && area > 0.0f)
+				return false;
+			if (eCullMode::FRONT == aPipeline.cull && area < 0.0f)
+				return false;
+		}
+
+		//screen bounds
+		const float min_x = std::min({ vertices[0].x(), vertices[1].x(), vertices[2].x() });
+		const float max_x = std::max({ vertices[0].x(), vertices[1].x(), vertices[2].x() });
+		const float min_y = std::min({ vertices[0].y(), vertices[1].y(), vertices[2].y() });
+		const float max_y = std::max({ vertices[0].y(), vertices[1].y(), vertices[2].y() });
+
+		if (max_x < 0.0f || max_y < 0.0f || min_x >= m_width || min_y >= m_height)
+			return false;
+
+		aSetup.bounds.x0 = static_cast<int32_t>(std::max(min_x, 0.0f));
+		aSetup.bounds.y0 = static_cast<int32_t>(std::max(min_y, 0.0f));
+		aSetup.bounds.x1 = static_cast<int32_t>(std::min(max_x + 1.0f, static_cast<float>(m_width)));
+		aSetup.bounds.y1 = static_cast<int32_t>(std::min(max_y + 1.0f, static_cast<float>(m_height)));
+
+		//opaque sort key: coarse depth slab | pipeline | exact depth
+		//(depth is >= 0, so the float bits order like the values)
+		const float min_z = std::min({ vertices[0].z(), vertices[1].z(), vertices[2].z() });
+		const uint64_t depth_slab = static_cast<uint64_t>(std::min(min_z, 1.0f) * 255.0f);
+		uint32_t depth_bits;
+		memcpy(&depth_bits, &min_z, sizeof(depth_bits));
+
+		aSetup.sort_key = (depth_slab << 56) | (static_cast<uint64_t>(aPipeline.id & 0xFFFFFF) << 32) | depth_bits;
+
+		aSetup.is_valid = true;
+		return true;
+	}
+
+	void Render::impl_rasterTriangle(const tSetupTriangle& aSetup, const tTarget& aTarget)
+	{
+		const tPipelineState& pipeline = *aSetup.pipeline;
+		const auto& vertices = aSetup.vertices;
+
+		if (pipeline.wireframe) {
+			impl_drawLine(vertices[0], vertices[1], aSetup.color, pipeline, aTarget);
+			impl_drawLine(vertices[1], vertices[2], aSetup.color, pipeline, aTarget);
+			impl_drawLine(vertices[2], vertices[0], aSetup.color, pipeline, aTarget);
 		}
 		else {
-			Render::impl_drawTriangleFilled(vertices, aDrawOptions);
+			Render::impl_drawTriangleFilled(vertices.data(), aSetup.color, pipeline, aTarget);
 		}
 	}
 
@@ -509,6 +1610,82 @@ namespace SoftRender
 	{
 	}
 
+	tFrustum::tFrustum()
+		: tFrustum(tFov())
+	{
+	}
+
+	tFrustum::tFrustum(const tFov& aFov)
+	{
+		//visible: |x| <= z * near_plane.x / (2 * near_distance), same for y
+		const float slope_x = aFov.near_plane.x() / (2.0f * aFov.near_distance);
+		const float slope_y = aFov.near_plane.y() / (2.0f * aFov.near_distance);
+
+		const Vector3f left = Vector3f(1.0f, 0.0f, slope_x).normalized();
+		const Vector3f right = Vector3f(-1.0f, 0.0f, slope_x).normalized();
+		const Vector3f top = Vector3f(0.0f, 1.0f, slope_y).normalized();
+		const Vector3f bottom = Vector3f(0.0f, -1.0f, slope_y).normalized();
+
+		planes[0] = Vector4f(left.x(), left.y(), left.z(), 0.0f);
+		planes[1] = Vector4f(right.x(), right.y(), right.z(), 0.0f);
+		planes[2] = Vector4f(top.x(), top.y(), top.z(), 0.0f);
+		planes[3] = Vector4f(bottom.x(), bottom.y(), bottom.z(), 0.0f);
+		planes[4] = Vector4f(0.0f, 0.0f, 1.0f, 0.0f);
+		planes[5] = Vector4f(0.0f, 0.0f, -1.0f, aFov.far_distance);
+	}
+
+	bool tFrustum::intersects_sphere(const Vector3f& aCenter, float aRadius) const
+	{
+		for (const Vector4f& iPlane : planes) {
+			if (iPlane.head<3>().dot(aCenter) + iPlane.w() < -aRadius)
+				return false;
+		}
+		return true;
+	}
+
+	tFrustum tFrustum::transformed(const Matrix4f& aView) const
+	{
+		//dot(plane, view * p) == dot(view^T * plane, p)
+		tFrustum ret;
+		const Matrix4f view_t = aView.transpose();
+
+		for (size_t iPlane = 0; iPlane < planes.size(); iPlane++) {
+			const Vector4f plane = view_t * planes[iPlane];
+			ret.planes[iPlane] = plane / plane.head<3>().norm();
+		}
+
+		return ret;
+	}
+
+	bool tFrustum::intersects_aabb(const Vector3f& aMin, const Vector3f& aMax) const
+	{
+		return eCoverage::OUTSIDE != classify_aabb(aMin, aMax);
+	}
+
+	eCoverage tFrustum::classify_aabb(const Vector3f& aMin, const Vector3f& aMax) const
+	{
+		eCoverage ret = eCoverage::INSIDE;
+
+		for (const Vector4f& iPlane : planes) {
+			//corners furthest along and against the plane normal
+			const Vector3f far_corner(
+				iPlane.x() >= 0.0f ? aMax.x() : aMin.x(),
+				iPlane.y() >= 0.0f ? aMax.y() : aMin.y(),
+				iPlane.z() >= 0.0f ? aMax.z() : aMin.z());
+			const Vector3f near_corner(
+				iPlane.x() >= 0.0f ? aMin.x() : aMax.x(),
+				iPlane.y() >= 0.0f ? aMin.y() : aMax.y(),
+				iPlane.z() >= 0.0f ? aMin.z() : aMax.z());
+
+			if (iPlane.head<3>().dot(far_corner) + iPlane.w() < 0.0f)
+				return eCoverage::OUTSIDE;
+			if (iPlane.head<3>().dot(near_corner) + iPlane.w() < 0.0f)
+				ret = eCoverage::INTERSECTS;
+		}
+
+		return ret;
+	}
+
 	tFov::tFov(float aNearDistance, Vector2f aNearPlane, float aFarDisance)
 		: near_distance(aNearDistance), near_plane(aNearPlane), far_distance(aFarDisance) 
 	{
@@ -0,0 +1,95 @@
+#include "render_arena.h"
+#include <algorithm>
+
+namespace SoftRender
+{
+	atomic<uint64_t> FrameArena::s_frame{ 0 };
+
+	FrameArena& FrameArena::local()
+	{
+		thread_local FrameArena arena;
+
+		//a scope open across swap_buffer keeps its memory until it ends
+		if (0 == arena.m_scopes && arena.m_frame != s_frame)
+			arena.impl_startFrame();
+
+		return arena;
+	}
+
+	void FrameArena::next_frame()
+	{
+		s_frame++;
+	}
+
+	void* FrameArena::allocate(size_t aSize, size_t aAlign)
+	{
+		while (m_block < m_blocks.size()) {
+			tBlock& block = m_blocks[m_block];
+			const uintptr_t base = reinterpret_cast<uintptr_t>(block.data.get());
+			const size_t offset = static_cast<size_t>(((base + m_offset + aAlign - 1) & ~(uintptr_t(aAlign) - 1)) - base);
+
+			if (offset + aSize <= block.size) {
+				m_offset = offset + aSize;
+				return block.data.get() + offset;
+			}
+
+			m_block++;
+			m_offset = 0;
+		}
+
+		//at least doubles the capacity, so a frame needs few blocks
+		const size_t size = std::max({ MIN_BLOCK_SIZE, aSize + aAlign, capacity() });
+		m_blocks.push_back({ unique_ptr<char[]>(new char[size]), size });
+		m_block = m_blocks.size() - 1;
+		m_offset = 0;
+
+		return allocate(aSize, aAlign);
+	}
+
+	FrameArena::tMark FrameArena::mark() const
+	{
+		return { m_block, m_offset };
+	}
+
+	void FrameArena::rewind(const tMark& aMark)
+	{
+		m_block = aMark.block;
+		m_offset = aMark.offset;
+	}
+
+	size_t FrameArena::capacity() const
+	{
+		size_t ret = 0;
+		for (const tBlock& iBlock : m_blocks) {
+			ret += iBlock.size;
+		}
+		return ret;
+	}
+
+	void FrameArena::impl_startFrame()
+	{
+		m_frame = s_frame;
+		m_block = 0;
+		m_offset = 0;
+
+		//the last frame needed several blocks: merge them, so the next
+		//ones fit into a single block
+		if (m_blocks.size() > 1) {
+			const size_t size = capacity();
+			m_blocks.clear();
+			m_blocks.push_back({ unique_ptr<char[]>(new char[size]), size });
+		}
+	}
+
+	ArenaScope::ArenaScope()
+		: m_arena(FrameArena::local()), m_mark(m_arena.mark())
+	{
+		m_arena.m_scopes++;
+	}
+
+	ArenaScope::~ArenaScope()
+	{
+		m_arena.m_scopes--;
+		m_arena.rewind(m_mark);
+	}
+}
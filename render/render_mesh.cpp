@@ -0,0 +1,350 @@
+#include "render_mesh.h"
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <Eigen/Geometry>
+
+namespace SoftRender
+{
+	tBounds tBounds::from_points(const Vector4f* aPoints, size_t aCount)
+	{
+		tBounds ret;
+		if (0 == aCount)
+			return ret;
+
+		ret.min = aPoints[0].head<3>();
+		ret.max = aPoints[0].head<3>();
+		for (size_t iPoint = 1; iPoint < aCount; iPoint++) {
+			ret.min = ret.min.cwiseMin(aPoints[iPoint].head<3>());
+			ret.max = ret.max.cwiseMax(aPoints[iPoint].head<3>());
+		}
+
+		ret.center = (ret.min + ret.max) * 0.5f;
+		for (size_t iPoint = 0; iPoint < aCount; iPoint++) {
+			ret.radius = std::max(ret.radius, (aPoints[iPoint].head<3>() - ret.center).norm());
+		}
+
+		return ret;
+	}
+
+	void tBounds::transformSphere(const Matrix4f& aTransform, Vector3f& aCenter, float& aRadius) const
+	{
+		const Matrix3f linear = aTransform.block<3, 3>(0, 0);
+		const float max_scale = std::max({ linear.col(0).norm(), linear.col(1).norm(), linear.col(2).norm() });
+
+		aCenter = linear * center + aTransform.block<3, 1>(0, 3);
+		aRadius = radius * max_scale;
+	}
+
+	size_t tMesh::triangleCount() const
+	{
+		return indices.size() / 3;
+	}
+
+	void tMesh::updateBounds()
+	{
+		bounds = tBounds::from_points(positions.data(), positions.size());
+	}
+
+	tMesh tMesh::from_triangles(const vector<array<Vector4f, 3>>& aTriangles)
+	{
+		tMesh ret;
+		map<array<float, 4>, uint32_t> vertex_idx;
+
+		for (const auto& iTriangle : aTriangles) {
+			for (const Vector4f& iVertex : iTriangle) {
+				const array<float, 4> key = { iVertex[0], iVertex[1], iVertex[2], iVertex[3] };
+				auto found = vertex_idx.find(key);
+
+				if (found == vertex_idx.end()) {
+					found = vertex_idx.emplace(key, static_cast<uint32_t>(ret.positions.size())).first;
+					ret.positions.push_back(iVertex);
+				}
+
+				ret.indices.push_back(found->second);
+			}
+		}
+
+		ret.updateBounds();
+		return ret;
+	}
+
+	//---------------------------------------------------------
+	// tClusterBounds
+	//---------------------------------------------------------
+	tClusterBounds tClusterBounds::from_triangles(const Vector4f* aVertices, size_t aVertexCount, const uint8_t* aIndices, size_t aTriangleCount)
+	{
+		tClusterBounds ret;
+
+		const tBounds sphere = tBounds::from_points(aVertices, aVertexCount);
+		ret.center = sphere.center;
+		ret.radius = sphere.radius;
+
+		//cone: the normals spread at most acos(min_dot) around the axis
+		vector<Vector3f> normals;
+		Vector3f axis = Vector3f::Zero();
+		for (size_t iTriangle = 0; iTriangle < aTriangleCount; iTriangle++) {
+			const uint8_t* idx = &aIndices[iTriangle * 3];
+			const Vector3f v0 = aVertices[idx[0]].head<3>();
+			const Vector3f v1 = aVertices[idx[1]].head<3>();
+			const Vector3f v2 = aVertices[idx[2]].head<3>();
+
+			const Vector3f normal = (v1 - v0).cross(v2 - v0);
+			if (normal.norm() > 0.0f) {
+				normals.push_back(normal.normalized());
+				axis += normals.back();
+			}
+		}
+
+		if (0.0f == axis.norm())
+			return ret;
+
+		ret.cone_axis = axis.normalized();
+
+		float min_dot = 1.0f;
+		for (const Vector3f& iNormal : normals) {
+			min_dot = std::min(min_dot, iNormal.dot(ret.cone_axis));
+		}
+		if (min_dot > 0.0f)
+			ret.cone_cutoff = std::sqrt(1.0f - min_dot * min_dot);
+
+		return ret;
+	}
+
+	bool tClusterBounds::is_backfacing(const Vector3f& aCamera) const
+	{
+		if (cone_cutoff >= 1.0f)
+			return false;
+
+		//every point of the sphere sees only the back of the normal cone
+		const Vector3f to_center = center - aCamera;
+		return to_center.dot(cone_axis) >= cone_cutoff * to_center.norm() + radius;
+	}
+
+	//---------------------------------------------------------
+	// tMeshlets
+	//---------------------------------------------------------
+	tMeshlets tMeshlets::build(const tMesh& aMesh, uint32_t aMaxTriangles, uint32_t aMaxVertices)
+	{
+		if (0 == aMaxTriangles || aMaxVertices < 3 || aMaxVertices > 256)
+			throw "meshlets need 1+ triangles and 3 to 256 vertices";
+
+		const size_t triangle_count = aMesh.triangleCount();
+		const size_t vertex_count = aMesh.positions.size();
+		const uint32_t unused = numeric_limits<uint32_t>::max();
+
+		//vertex -> triangle adjacency
+		vector<uint32_t> offsets(vertex_count + 1, 0);
+		for (uint32_t iIdx : aMesh.indices) {
+			offsets[iIdx + 1]++;
+		}
+		for (size_t iVertex = 0; iVertex < vertex_count; iVertex++) {
+			offsets[iVertex + 1] += offsets[iVertex];
+		}
+
+		vector<uint32_t> adjacency(aMesh.indices.size());
+		vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+		for (size_t iIdx = 0; iIdx < aMesh.indices.size(); iIdx++) {
+			adjacency[fill[aMesh.indices[iIdx]]++] = static_cast<uint32_t>(iIdx / 3);
+		}
+
+		tMeshlets ret;
+		vector<bool> is_emitted(triangle_count, false);
+		vector<uint32_t> local(vertex_count, unused);	//meshlet vertex of a mesh vertex
+		vector<Vector4f> positions;
+		size_t cursor = 0;
+
+		auto new_vertices = [&](uint32_t aTriangle) {
+			uint32_t count = 0;
+			for (size_t iVertex = 0; iVertex < 3; iVertex++) {
+				count += unused == local[aMesh.indices[aTriangle * 3 + iVertex]] ? 1 : 0;
+			}
+			return count;
+		};
+
+		while (true) {
+			while (cursor < triangle_count && is_emitted[cursor]) {
+				cursor++;
+			}
+			if (cursor >= triangle_count)
+				break;
+
+			tMeshlet meshlet;
+			meshlet.first_vertex = static_cast<uint32_t>(ret.vertices.size());
+			meshlet.vertex_count = 0;
+			meshlet.first_triangle = static_cast<uint32_t>(ret.triangles.size());
+			meshlet.triangle_count = 0;
+
+			uint32_t next = static_cast<uint32_t>(cursor);
+
+			while (unused != next) {
+				//emit
+				for (size_t iVertex = 0; iVertex < 3; iVertex++) {
+					const uint32_t vertex = aMesh.indices[next * 3 + iVertex];
+					if (unused == local[vertex]) {
+						local[vertex] = meshlet.vertex_count++;
+						ret.vertices.push_back(vertex);
+					}
+					ret.indices.push_back(static_cast<uint8_t>(local[vertex]));
+				}
+				ret.triangles.push_back(next);
+				is_emitted[next] = true;
+				meshlet.triangle_count++;
+
+				if (meshlet.triangle_count >= aMaxTriangles)
+					break;
+
+				//best neighbour over the meshlet's vertices
+				next = unused;
+				uint32_t best_cost = 4;
+				for (uint32_t iVertex = meshlet.first_vertex; iVertex < ret.vertices.size() && best_cost > 0; iVertex++) {
+					const uint32_t vertex = ret.vertices[iVertex];
+
+					for (uint32_t iAdj = offsets[vertex]; iAdj < offsets[vertex + 1]; iAdj++) {
+						const uint32_t triangle = adjacency[iAdj];
+						if (is_emitted[triangle])
+							continue;
+
+						const uint32_t cost = new_vertices(triangle);
+						if (cost < best_cost && meshlet.vertex_count + cost <= aMaxVertices) {
+							best_cost = cost;
+							next = triangle;
+						}
+					}
+				}
+			}
+
+			//reset only the entries this meshlet used
+			positions.clear();
+			for (uint32_t iVertex = meshlet.first_vertex; iVertex < ret.vertices.size(); iVertex++) {
+				local[ret.vertices[iVertex]] = unused;
+				positions.push_back(aMesh.positions[ret.vertices[iVertex]]);
+			}
+
+			meshlet.bounds = tClusterBounds::from_triangles(positions.data(), positions.size(), &ret.indices[meshlet.first_triangle * 3], meshlet.triangle_count);
+			ret.meshlets.push_back(meshlet);
+		}
+
+		return ret;
+	}
+
+	//---------------------------------------------------------
+	// tVertexLayout
+	//---------------------------------------------------------
+	namespace
+	{
+		float half_to_float(uint16_t aHalf)
+		{
+			const uint32_t sign = static_cast<uint32_t>(aHalf & 0x8000) << 16;
+			uint32_t exponent = (aHalf >> 10) & 0x1F;
+			uint32_t mantissa = aHalf & 0x3FF;
+			uint32_t bits;
+
+			if (0 == exponent) {
+				if (0 == mantissa) {
+					bits = sign;
+				}
+				else {
+					//denormal: normalize
+					exponent = 127 - 15 + 1;
+					while (0 == (mantissa & 0x400)) {
+						mantissa <<= 1;
+						exponent--;
+					}
+					bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+				}
+			}
+			else if (0x1F == exponent) {
+				bits = sign | 0x7F800000 | (mantissa << 13);
+			}
+			else {
+				bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+			}
+
+			float ret;
+			memcpy(&ret, &bits, sizeof(ret));
+			return ret;
+		}
+	}
+
+	tVertexLayout& tVertexLayout::stride(uint32_t aStride)
+	{
+		m_stride = aStride;
+		return *this;
+	}
+
+	tVertexLayout& tVertexLayout::position(uint32_t aOffset, eVertexFormat aFormat)
+	{
+		m_position_offset = aOffset;
+		m_position_format = aFormat;
+		return *this;
+	}
+
+	tVertexLayout& tVertexLayout::color(uint32_t aOffset)
+	{
+		m_color_offset = aOffset;
+		return *this;
+	}
+
+	Vector4f tVertexLayout::fetchPosition(const void* aVertices, uint32_t aIdx) const
+	{
+		const uint8_t* src = static_cast<const uint8_t*>(aVertices) + static_cast<size_t>(aIdx) * m_stride + m_position_offset;
+		Vector4f ret(0.0f, 0.0f, 0.0f, 1.0f);
+
+		switch (m_position_format) {
+		case eVertexFormat::FLOAT3:
+		case eVertexFormat::FLOAT4: {
+			const size_t count = eVertexFormat::FLOAT3 == m_position_format ? 3 : 4;
+			memcpy(ret.data(), src, count * sizeof(float));
+			break;
+		}
+		case eVertexFormat::HALF3:
+		case eVertexFormat::HALF4: {
+			const size_t count = eVertexFormat::HALF3 == m_position_format ? 3 : 4;
+			uint16_t values[4];
+			memcpy(values, src, count * sizeof(uint16_t));
+			for (size_t iValue = 0; iValue < count; iValue++) {
+				ret[iValue] = half_to_float(values[iValue]);
+			}
+			break;
+		}
+		case eVertexFormat::SNORM16_3:
+		case eVertexFormat::SNORM16_4: {
+			const size_t count = eVertexFormat::SNORM16_3 == m_position_format ? 3 : 4;
+			int16_t values[4];
+			memcpy(values, src, count * sizeof(int16_t));
+			for (size_t iValue = 0; iValue < count; iValue++) {
+				ret[iValue] = std::max(values[iValue] / 32767.0f, -1.0f);
+			}
+			break;
+		}
+		}
+
+		return ret;
+	}
+
+	uint32_t tVertexLayout::fetchColor(const void* aVertices, uint32_t aIdx) const
+	{
+		uint32_t ret;
+		memcpy(&ret, static_cast<const uint8_t*>(aVertices) + static_cast<size_t>(aIdx) * m_stride + m_color_offset.value(), sizeof(ret));
+		return ret;
+	}
+
+	//---------------------------------------------------------
+	// tMeshLod
+	//---------------------------------------------------------
+	size_t tMeshLod::select(float aScreenDiameter) const
+	{
+		if (levels.empty() || min_pixels.size() != levels.size())
+			throw "tMeshLod needs one min_pixels entry per level";
+
+		for (size_t iLevel = 0; iLevel < levels.size(); iLevel++) {
+			if (aScreenDiameter >= min_pixels[iLevel])
+				return iLevel;
+		}
+
+		return levels.size() - 1;
+	}
+}
@@ -0,0 +1,499 @@
+#include "render_mesh_io.h"
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace SoftRender
+{
+	//---------------------------------------------------------
+	// helper
+	//---------------------------------------------------------
+	namespace
+	{
+		struct tMeshCacheHeader
+		{
+			char magic[4];
+			uint32_t version;
+			uint64_t vertex_count;
+			uint64_t index_count;
+		};
+
+		constexpr char MESH_CACHE_MAGIC[4] = { 'S', 'R', 'M', 'C' };
+
+		void add_polygon(tMeshBuffers& aMesh, const vector<uint32_t>& aPolygon)
+		{
+			for (size_t iVertex = 2; iVertex < aPolygon.size(); iVertex++) {
+				aMesh.indices.push_back(aPolygon[0]);
+				aMesh.indices.push_back(aPolygon[iVertex - 1]);
+				aMesh.indices.push_back(aPolygon[iVertex]);
+			}
+		}
+	}
+
+	//---------------------------------------------------------
+	// tMeshBuffers
+	//---------------------------------------------------------
+	size_t tMeshBuffers::vertexCount() const
+	{
+		return x.size();
+	}
+
+	tMesh tMeshBuffers::toMesh() const
+	{
+		tMesh ret;
+
+		ret.positions.resize(vertexCount());
+		for (size_t iVertex = 0; iVertex < vertexCount(); iVertex++) {
+			ret.positions[iVertex] = Vector4f(x[iVertex], y[iVertex], z[iVertex], 1.0f);
+		}
+		ret.indices = indices;
+		ret.updateBounds();
+
+		return ret;
+	}
+
+	//---------------------------------------------------------
+	// OBJ
+	//---------------------------------------------------------
+	tMeshBuffers load_obj(const string& aPath)
+	{
+		ifstream file(aPath);
+		if (!file)
+			throw "could not open obj file";
+
+		tMeshBuffers ret;
+		string line;
+		vector<uint32_t> polygon;
+
+		while (getline(file, line)) {
+			if (line.size() < 2)
+				continue;
+
+			if ('v' == line[0] && ' ' == line[1]) {
+				float x = 0.0f, y = 0.0f, z = 0.0f;
+				istringstream values(line.substr(2));
+				values >> x >> y >> z;
+
+				ret.x.push_back(x);
+				ret.y.push_back(y);
+				ret.z.push_back(z);
+			}
+			else if ('f' == line[0] && ' ' == line[1]) {
+				//"f v", "f v/vt", "f v//vn", "f v/vt/vn"; negative is relative to the end
+				istringstream values(line.substr(2));
+				string token;
+				polygon.clear();
+
+				while (values >> token) {
+					const long idx = strtol(token.c_str(), nullptr, 10);
+					const long vertex = idx < 0 ? static_cast<long>(ret.vertexCount()) + idx : idx - 1;
+
+					if (vertex < 0 || vertex >= static_cast<long>(ret.vertexCount()))
+						throw "obj face references an unknown vertex";
+
+					polygon.push_back(static_cast<uint32_t>(vertex));
+				}
+
+				add_polygon(ret, polygon);
+			}
+		}
+
+		return ret;
+	}
+
+	//---------------------------------------------------------
+	// PLY
+	//---------------------------------------------------------
+	namespace
+	{
+		enum class ePlyFormat {
+			ASCII,
+			BINARY_LITTLE_ENDIAN,
+			BINARY_BIG_ENDIAN,
+		};
+
+		struct tPlyProperty {
+			string name;
+			string type;
+			string list_count_type;	//empty if not a list
+		};
+
+		struct tPlyElement {
+			string name;
+			size_t count;
+			vector<tPlyProperty> properties;
+		};
+
+		size_t ply_type_size(const string& aType)
+		{
+			if ("char" == aType || "uchar" == aType || "int8" == aType || "uint8" == aType)
+				return 1;
+			if ("short" == aType || "ushort" == aType || "int16" == aType || "uint16" == aType)
+				return 2;
+			if ("int" == aType || "uint" == aType || "float" == aType || "int32" == aType || "uint32" == aType || "float32" == aType)
+				return 4;
+			if ("double" == aType || "float64" == aType)
+				return 8;
+
+			throw "unknown ply property type";
+		}
+
+		double ply_read_value(istream& aFile, ePlyFormat aFormat, const string& aType)
+		{
+			if (ePlyFormat::ASCII == aFormat) {
+				double value = 0.0;
+				aFile >> value;
+				return value;
+			}
+
+			const size_t size = ply_type_size(aType);
+			uint8_t bytes[8];
+			aFile.read(reinterpret_cast<char*>(bytes), size);
+
+			//files are little or big endian, convert to the host order
+			const uint16_t probe = 1;
+			const bool host_little = 1 == *reinterpret_cast<const uint8_t*>(&probe);
+			if (host_little != (ePlyFormat::BINARY_LITTLE_ENDIAN == aFormat))
+				std::reverse(bytes, bytes + size);
+
+			auto as = [&bytes](auto aValue) -> double {
+				memcpy(&aValue, bytes, sizeof(aValue));
+				return static_cast<double>(aValue);
+			};
+
+			if ("char" == aType || "int8" == aType)				return as(int8_t());
+			if ("uchar" == aType || "uint8" == aType)			return as(uint8_t());
+			if ("short" == aType || "int16" == aType)			return as(int16_t());
+			if ("ushort" == aType || "uint16" == aType)			return as(uint16_t());
+			if ("int" == aType || "int32" == aType)				return as(int32_t());
+			if ("uint" == aType || "uint32" == aType)			return as(uint32_t());
+			if ("float" == aType || "float32" == aType)			return as(float());
+			return as(double());
+		}
+	}
+
+	tMeshBuffers load_ply(const string& aPath)
+	{
+		ifstream file(aPath, ios::binary);
+		if (!file)
+			throw "could not open ply file";
+
+		//header
+		string line;
+		getline(file, line);
+		if (0 != line.rfind("ply", 0))
+			throw "not a ply file";
+
+		ePlyFormat format = ePlyFormat::ASCII;
+		vector<tPlyElement> elements;
+
+		while (getline(file, line)) {
+			if (!line.empty() && '\r' == line.back())
+				line.pop_back();
+
+			istringstream words(line);
+			string keyword;
+			words >> keyword;
+
+			if ("end_header" == keyword) {
+				break;
+			}
+			else if ("format" == keyword) {
+				string name;
+				words >> name;
+				if ("binary_little_endian" == name)
+					format = ePlyFormat::BINARY_LITTLE_ENDIAN;
+				else if ("binary_big_endian" == name)
+					format = ePlyFormat::BINARY_BIG_ENDIAN;
+			}
+			else if ("element" == keyword) {
+				tPlyElement element;
+				words >> element.name >> element.count;
+				elements.push_back(element);
+			}
+			else if ("property" == keyword) {
+				if (elements.empty())
+					throw "ply property without element";
+
+				tPlyProperty property;
+				words >> property.type;
+				if ("list" == property.type)
+					words >> property.list_count_type >> property.type;
+				words >> property.name;
+
+				elements.back().properties.push_back(property);
+			}
+		}
+
+		//body, element by element
+		tMeshBuffers ret;
+		vector<uint32_t> polygon;
+
+		for (const tPlyElement& iElement : elements) {
+			const bool is_vertex = "vertex" == iElement.name;
+			const bool is_face = "face" == iElement.name;
+
+			if (is_vertex) {
+				ret.x.reserve(iElement.count);
+				ret.y.reserve(iElement.count);
+				ret.z.reserve(iElement.count);
+			}
+
+			for (size_t iItem = 0; iItem < iElement.count; iItem++) {
+				float position[3] = { 0.0f, 0.0f, 0.0f };
+
+				for (const tPlyProperty& iProperty : iElement.properties) {
+					if (!iProperty.list_count_type.empty()) {
+						const size_t count = static_cast<size_t>(ply_read_value(file, format, iProperty.list_count_type));
+						const bool is_indices = is_face && ("vertex_indices" == iProperty.name || "vertex_index" == iProperty.name);
+
+						polygon.clear();
+						for (size_t iValue = 0; iValue < count; iValue++) {
+							const double value = ply_read_value(file, format, iProperty.type);
+							if (is_indices)
+								polygon.push_back(static_cast<uint32_t>(value));
+						}
+
+						if (is_indices)
+							add_polygon(ret, polygon);
+						continue;
+					}
+
+					const double value = ply_read_value(file, format, iProperty.type);
+					if (is_vertex && "x" == iProperty.name)	position[0] = static_cast<float>(value);
+					if (is_vertex && "y" == iProperty.name)	position[1] = static_cast<float>(value);
+					if (is_vertex && "z" == iProperty.name)	position[2] = static_cast<float>(value);
+				}
+
+				if (!file)
+					throw "ply file ends early";
+
+				if (is_vertex) {
+					ret.x.push_back(position[0]);
+					ret.y.push_back(position[1]);
+					ret.z.push_back(position[2]);
+				}
+			}
+		}
+
+		for (uint32_t iIdx : ret.indices) {
+			if (iIdx >= ret.vertexCount())
+				throw "ply face references an unknown vertex";
+		}
+
+		return ret;
+	}
+
+	tMeshBuffers load_mesh(const string& aPath)
+	{
+		string extension = filesystem::path(aPath).extension().string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](char aChar) { return static_cast<char>(tolower(aChar)); });
+
+		if (".obj" == extension)
+			return load_obj(aPath);
+		if (".ply" == extension)
+			return load_ply(aPath);
+
+		throw "unknown mesh file extension";
+	}
+
+	//---------------------------------------------------------
+	// cache
+	//---------------------------------------------------------
+	void write_mesh_cache(const string& aPath, const tMeshBuffers& aMesh)
+	{
+		ofstream file(aPath, ios::binary | ios::trunc);
+		if (!file)
+			throw "could not write mesh cache";
+
+		tMeshCacheHeader header;
+		memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+		header.version = MESH_CACHE_VERSION;
+		header.vertex_count = aMesh.vertexCount();
+		header.index_count = aMesh.indices.size();
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(aMesh.x.data()), aMesh.x.size() * sizeof(float));
+		file.write(reinterpret_cast<const char*>(aMesh.y.data()), aMesh.y.size() * sizeof(float));
+		file.write(reinterpret_cast<const char*>(aMesh.z.data()), aMesh.z.size() * sizeof(float));
+		file.write(reinterpret_cast<const char*>(aMesh.indices.data()), aMesh.indices.size() * sizeof(uint32_t));
+
+		if (!file)
+			throw "could not write mesh cache";
+	}
+
+	MappedMeshCache::MappedMeshCache(const string& aPath)
+	{
+#ifdef _WIN32
+		m_file = CreateFileA(aPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (INVALID_HANDLE_VALUE == m_file) {
+			m_file = nullptr;
+			throw "could not open mesh cache";
+		}
+
+		LARGE_INTEGER size;
+		GetFileSizeEx(m_file, &size);
+		m_size = static_cast<size_t>(size.QuadPart);
+
+		m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_mapping)
+			m_data = reinterpret_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+		const int fd = open(aPath.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw "could not open mesh cache";
+
+		struct stat info;
+		if (0 == fstat(fd, &info) && info.st_size > 0) {
+			m_size = static_cast<size_t>(info.st_size);
+			void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			m_data = MAP_FAILED == data ? nullptr : reinterpret_cast<const uint8_t*>(data);
+		}
+		close(fd);
+#endif
+
+		tMeshCacheHeader header;
+		const bool is_valid = [&]() {
+			if (!m_data || m_size < sizeof(header))
+				return false;
+
+			memcpy(&header, m_data, sizeof(header));
+			if (0 != memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) || MESH_CACHE_VERSION != header.version)
+				return false;
+
+			//counts first, so the payload size cannot overflow
+			if (header.vertex_count > m_size || header.index_count > m_size)
+				return false;
+
+			const uint64_t payload = header.vertex_count * 3 * sizeof(float) + header.index_count * sizeof(uint32_t);
+			if (m_size != sizeof(header) + payload)
+				return false;
+
+			//once here, so a corrupt file never reads out of bounds in a draw
+			const uint32_t* indices = reinterpret_cast<const uint32_t*>(m_data + sizeof(header) + header.vertex_count * 3 * sizeof(float));
+			return std::all_of(indices, indices + header.index_count, [&header](uint32_t aIdx) {
+				return aIdx < header.vertex_count;
+			});
+		}();
+
+		if (!is_valid) {
+			impl_unmap();
+			throw "invalid or outdated mesh cache";
+		}
+
+		m_vertex_count = static_cast<size_t>(header.vertex_count);
+		m_index_count = static_cast<size_t>(header.index_count);
+	}
+
+	MappedMeshCache::~MappedMeshCache()
+	{
+		impl_unmap();
+	}
+
+	void MappedMeshCache::impl_unmap()
+	{
+#ifdef _WIN32
+		if (m_data)
+			UnmapViewOfFile(m_data);
+		if (m_mapping)
+			CloseHandle(m_mapping);
+		if (m_file)
+			CloseHandle(m_file);
+		m_mapping = nullptr;
+		m_file = nullptr;
+#else
+		if (m_data)
+			munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+		m_data = nullptr;
+	}
+
+	size_t MappedMeshCache::vertexCount() const
+	{
+		return m_vertex_count;
+	}
+
+	size_t MappedMeshCache::indexCount() const
+	{
+		return m_index_count;
+	}
+
+	const float* MappedMeshCache::x() const
+	{
+		return reinterpret_cast<const float*>(m_data + sizeof(tMeshCacheHeader));
+	}
+
+	const float* MappedMeshCache::y() const
+	{
+		return x() + m_vertex_count;
+	}
+
+	const float* MappedMeshCache::z() const
+	{
+		return y() + m_vertex_count;
+	}
+
+	const uint32_t* MappedMeshCache::indices() const
+	{
+		return reinterpret_cast<const uint32_t*>(z() + m_vertex_count);
+	}
+
+	tMesh MappedMeshCache::toMesh() const
+	{
+		tMesh ret;
+
+		ret.positions.resize(m_vertex_count);
+		for (size_t iVertex = 0; iVertex < m_vertex_count; iVertex++) {
+			ret.positions[iVertex] = Vector4f(x()[iVertex], y()[iVertex], z()[iVertex], 1.0f);
+		}
+		ret.indices.assign(indices(), indices() + m_index_count);
+		ret.updateBounds();
+
+		return ret;
+	}
+
+	unique_ptr<MappedMeshCache> load_mesh_cached(const string& aSourcePath, const string& aCachePath)
+	{
+		std::error_code error;
+		const bool cache_exists = filesystem::exists(aCachePath, error);
+		const bool source_exists = filesystem::exists(aSourcePath, error);
+
+		bool is_fresh = cache_exists;
+		if (cache_exists && source_exists)
+			is_fresh = filesystem::last_write_time(aCachePath, error) >= filesystem::last_write_time(aSourcePath, error);
+
+		if (is_fresh) {
+			try {
+				return make_unique<MappedMeshCache>(aCachePath);
+			}
+			catch (const char*) {
+				//outdated version or broken file: rebuild below
+			}
+		}
+
+		//written aside and renamed over the cache, so a crash or another
+		//reader never sees a half written file
+		const string temp_path = aCachePath + ".tmp";
+		write_mesh_cache(temp_path, load_mesh(aSourcePath));
+
+		filesystem::rename(temp_path, aCachePath, error);
+		if (error) {
+			filesystem::remove(temp_path, error);
+			throw "could not replace mesh cache";
+		}
+
+		return make_unique<MappedMeshCache>(aCachePath);
+	}
+}
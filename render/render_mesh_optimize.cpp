@@ -0,0 +1,259 @@
+#include "render_mesh_optimize.h"
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <Eigen/Geometry>
+
+namespace SoftRender
+{
+	//---------------------------------------------------------
+	// helper
+	//---------------------------------------------------------
+
+	namespace
+	{
+		//applies aOrder (old triangle index per new position) to indices and colors
+		void reorder_triangles(tMesh& aMesh, const vector<uint32_t>& aOrder)
+		{
+			vector<uint32_t> indices(aMesh.indices.size());
+			vector<uint32_t> colors(aMesh.triangle_colors.size());
+
+			for (size_t iTriangle = 0; iTriangle < aOrder.size(); iTriangle++) {
+				const uint32_t src = aOrder[iTriangle];
+				for (size_t iVertex = 0; iVertex < 3; iVertex++) {
+					indices[iTriangle * 3 + iVertex] = aMesh.indices[src * 3 + iVertex];
+				}
+				if (!colors.empty())
+					colors[iTriangle] = aMesh.triangle_colors[src];
+			}
+
+			aMesh.indices.swap(indices);
+			aMesh.triangle_colors.swap(colors);
+		}
+
+		//FIFO cache simulation, aMisses[i] is the number of transformed vertices of triangle i
+		void simulate_cache(const vector<uint32_t>& aIndices, size_t aVertexCount, uint32_t aCacheSize, vector<uint8_t>& aMisses)
+		{
+			//a vertex is cached while less than aCacheSize misses happened after its own
+			vector<size_t> cached_at(aVertexCount, 0);
+			size_t time = aCacheSize + 1;
+
+			aMisses.assign(aIndices.size() / 3, 0);
+			for (size_t iIdx = 0; iIdx < aIndices.size(); iIdx++) {
+				const uint32_t vertex = aIndices[iIdx];
+				if (time - cached_at[vertex] > aCacheSize) {
+					cached_at[vertex] = time++;
+					aMisses[iIdx / 3]++;
+				}
+			}
+		}
+	}
+
+	//---------------------------------------------------------
+	// vertex cache
+	//---------------------------------------------------------
+	void optimize_vertex_cache(tMesh& aMesh, uint32_t aCacheSize)
+	{
+		const size_t triangle_count = aMesh.triangleCount();
+		const size_t vertex_count = aMesh.positions.size();
+		if (0 == triangle_count)
+			return;
+
+		//vertex -> triangle adjacency
+		vector<uint32_t> live(vertex_count, 0);
+		for (uint32_t iIdx : aMesh.indices) {
+			live[iIdx]++;
+		}
+
+		vector<uint32_t> offsets(vertex_count + 1, 0);
+		for (size_t iVertex = 0; iVertex < vertex_count; iVertex++) {
+			offsets[iVertex + 1] = offsets[iVertex] + live[iVertex];
+		}
+
+		vector<uint32_t> adjacency(aMesh.indices.size());
+		vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+		for (size_t iIdx = 0; iIdx < aMesh.indices.size(); iIdx++) {
+			adjacency[fill[aMesh.indices[iIdx]]++] = static_cast<uint32_t>(iIdx / 3);
+		}
+
+		vector<size_t> cached_at(vertex_count, 0);
+		vector<bool> is_emitted(triangle_count, false);
+		vector<uint32_t> dead_end;
+		vector<uint32_t> candidates;
+		vector<uint32_t> order;
+		order.reserve(triangle_count);
+
+		size_t time = aCacheSize + 1;
+		size_t cursor = 0;
+		int64_t fanning = 0;
+
+		while (fanning >= 0) {
+			//emit all remaining triangles around the fanning vertex
+			candidates.clear();
+			for (uint32_t iAdj = offsets[fanning]; iAdj < offsets[fanning + 1]; iAdj++) {
+				const uint32_t triangle = adjacency[iAdj];
+				if (is_emitted[triangle])
+					continue;
+
+				for (size_t iVertex = 0; iVertex < 3; iVertex++) {
+					const uint32_t vertex = aMesh.indices[triangle * 3 + iVertex];
+					dead_end.push_back(vertex);
+					candidates.push_back(vertex);
+					live[vertex]--;
+					if (time - cached_at[vertex] > aCacheSize)
+						cached_at[vertex] = time++;
+				}
+
+				is_emitted[triangle] = true;
+				order.push_back(triangle);
+			}
+
+			//next: the candidate that is still cached after its remaining triangles
+			int64_t best = -1;
+			int64_t best_priority = -1;
+			for (uint32_t iVertex : candidates) {
+				if (0 == live[iVertex])
+					continue;
+
+				int64_t priority = 0;
+				if (time - cached_at[iVertex] + 2 * live[iVertex] <= aCacheSize)
+					priority = static_cast<int64_t>(time - cached_at[iVertex]);
+
+				if (priority > best_priority) {
+					best_priority = priority;
+					best = iVertex;
+				}
+			}
+
+			//dead end: recently used vertices first, then scan in input order
+			while (-1 == best && !dead_end.empty()) {
+				const uint32_t vertex = dead_end.back();
+				dead_end.pop_back();
+				if (live[vertex] > 0)
+					best = vertex;
+			}
+			while (-1 == best && cursor < vertex_count) {
+				if (live[cursor] > 0)
+					best = static_cast<int64_t>(cursor);
+				cursor++;
+			}
+
+			fanning = best;
+		}
+
+		reorder_triangles(aMesh, order);
+	}
+
+	//---------------------------------------------------------
+	// overdraw
+	//---------------------------------------------------------
+	void optimize_overdraw(tMesh& aMesh, uint32_t aCacheSize, float aThreshold)
+	{
+		const size_t triangle_count = aMesh.triangleCount();
+		if (0 == triangle_count)
+			return;
+
+		//cluster starts where the cache was flushed, as long as the
+		//order so far stays within aThreshold of the total ACMR
+		vector<uint8_t> misses;
+		simulate_cache(aMesh.indices, aMesh.positions.size(), aCacheSize, misses);
+
+		const float acmr = std::accumulate(misses.begin(), misses.end(), 0.0f) / triangle_count;
+
+		vector<uint32_t> cluster_start = { 0 };
+		size_t miss_sum = misses[0];
+		for (size_t iTriangle = 1; iTriangle < triangle_count; iTriangle++) {
+			if (3 == misses[iTriangle] && static_cast<float>(miss_sum) / iTriangle <= aThreshold * acmr)
+				cluster_start.push_back(static_cast<uint32_t>(iTriangle));
+			miss_sum += misses[iTriangle];
+		}
+		cluster_start.push_back(static_cast<uint32_t>(triangle_count));
+
+		//outward facing clusters first
+		const size_t cluster_count = cluster_start.size() - 1;
+		const Vector3f mesh_center = aMesh.bounds.center;
+		vector<float> sort_key(cluster_count);
+
+		for (size_t iCluster = 0; iCluster < cluster_count; iCluster++) {
+			Vector3f centroid = Vector3f::Zero();
+			Vector3f normal = Vector3f::Zero();
+			float area = 0.0f;
+
+			for (uint32_t iTriangle = cluster_start[iCluster]; iTriangle < cluster_start[iCluster + 1]; iTriangle++) {
+				const Vector3f v0 = aMesh.positions[aMesh.indices[iTriangle * 3 + 0]].head<3>();
+				const Vector3f v1 = aMesh.positions[aMesh.indices[iTriangle * 3 + 1]].head<3>();
+				const Vector3f v2 = aMesh.positions[aMesh.indices[iTriangle * 3 + 2]].head<3>();
+
+				const Vector3f cross = (v1 - v0).cross(v2 - v0);
+				const float triangle_area = cross.norm();
+
+				centroid += (v0 + v1 + v2) * (triangle_area / 3.0f);
+				normal += cross;
+				area += triangle_area;
+			}
+
+			if (area > 0.0f)
+				centroid /= area;
+			if (normal.norm() > 0.0f)
+				normal.normalize();
+
+			sort_key[iCluster] = (centroid - mesh_center).dot(normal);
+		}
+
+		vector<uint32_t> cluster_order(cluster_count);
+		std::iota(cluster_order.begin(), cluster_order.end(), 0);
+		std::stable_sort(cluster_order.begin(), cluster_order.end(), [&sort_key](uint32_t aA, uint32_t aB) {
+			return sort_key[aA] > sort_key[aB];
+		});
+
+		vector<uint32_t> order;
+		order.reserve(triangle_count);
+		for (uint32_t iCluster : cluster_order) {
+			for (uint32_t iTriangle = cluster_start[iCluster]; iTriangle < cluster_start[iCluster + 1]; iTriangle++) {
+				order.push_back(iTriangle);
+			}
+		}
+
+		reorder_triangles(aMesh, order);
+	}
+
+	//---------------------------------------------------------
+	// vertex fetch
+	//---------------------------------------------------------
+	void optimize_vertex_fetch(tMesh& aMesh)
+	{
+		const uint32_t unused = std::numeric_limits<uint32_t>::max();
+		vector<uint32_t> remap(aMesh.positions.size(), unused);
+		vector<Vector4f> positions;
+		positions.reserve(aMesh.positions.size());
+
+		for (uint32_t& iIdx : aMesh.indices) {
+			if (unused == remap[iIdx]) {
+				remap[iIdx] = static_cast<uint32_t>(positions.size());
+				positions.push_back(aMesh.positions[iIdx]);
+			}
+			iIdx = remap[iIdx];
+		}
+
+		//unreferenced vertices are dropped
+		aMesh.positions.swap(positions);
+	}
+
+	void optimize_mesh(tMesh& aMesh, uint32_t aCacheSize, float aOverdrawThreshold)
+	{
+		optimize_vertex_cache(aMesh, aCacheSize);
+		optimize_overdraw(aMesh, aCacheSize, aOverdrawThreshold);
+		optimize_vertex_fetch(aMesh);
+	}
+
+	float vertex_cache_acmr(const vector<uint32_t>& aIndices, size_t aVertexCount, uint32_t aCacheSize)
+	{
+		if (aIndices.empty())
+			return 0.0f;
+
+		vector<uint8_t> misses;
+		simulate_cache(aIndices, aVertexCount, aCacheSize, misses);
+
+		return std::accumulate(misses.begin(), misses.end(), 0.0f) / (aIndices.size() / 3);
+	}
+}
@@ -0,0 +1,272 @@
+#include "render_occlusion.h"
+#include <cmath>
+#include <limits>
+
+namespace SoftRender
+{
+	OcclusionBuffer::OcclusionBuffer(uint32_t aWidth, uint32_t aHeight)
+		: m_width(aWidth), m_height(aHeight), m_depth(aWidth * aHeight)
+	{
+		setCamera(tFov(), Matrix4f::Identity());
+	}
+
+	void OcclusionBuffer::setCamera(const tFov& aFov, const Matrix4f& aView)
+	{
+		m_view = aView;
+		m_near_distance = aFov.near_distance;
+		m_scale_x = m_width / aFov.near_plane.x();
+		m_scale_y = m_height / aFov.near_plane.y();
+
+		clear();
+	}
+
+	void OcclusionBuffer::clear()
+	{
+		std::fill(m_depth.begin(), m_depth.end(), numeric_limits<float>::max());
+		m_has_pyramid = false;
+	}
+
+	Vector3f OcclusionBuffer::project(const Vector4f& aCamera) const
+	{
+		//same mapping as Render::projectPoint, at buffer resolution
+		const float factor = m_near_distance / aCamera.z();
+
+		return Vector3f(
+			factor * aCamera.x() * m_scale_x + m_width / 2.0f,
+			factor * aCamera.y() * m_scale_y + m_height / 2.0f,
+			aCamera.z());
+	}
+
+	void OcclusionBuffer::addOccluder(const tMesh& aMesh, const Matrix4f& aTransform)
+	{
+		const Matrix4f to_camera = m_view * aTransform;
+
+		for (size_t iTriangle = 0; iTriangle < aMesh.triangleCount(); iTriangle++) {
+			const uint32_t* idx = &aMesh.indices[iTriangle * 3];
+			const Vector4f triangle[] = {
+				to_camera * aMesh.positions[idx[0]],
+				to_camera * aMesh.positions[idx[1]],
+				to_camera * aMesh.positions[idx[2]],
+			};
+
+			impl_rasterOccluder(triangle);
+		}
+	}
+
+	void OcclusionBuffer::addOccluder(const Vector4f* aWorldTriangle)
+	{
+		const Vector4f triangle[] = { m_view * aWorldTriangle[0], m_view * aWorldTriangle[1], m_view * aWorldTriangle[2] };
+		impl_rasterOccluder(triangle);
+	}
+
+	void OcclusionBuffer::impl_rasterOccluder(const Vector4f* aCameraTriangle)
+	{
+		//clipped occluders are dropped: fewer occluders stay conservative
+		for (int iVertex = 0; iVertex < 3; iVertex++) {
+			if (aCameraTriangle[iVertex].z() <= 0.0f)
+				return;
+		}
+
+		Vector3f p0 = project(aCameraTriangle[0]);
+		Vector3f p1 = project(aCameraTriangle[1]);
+		const Vector3f p2 = project(aCameraTriangle[2]);
+
+		float area = (p1.x() - p0.x()) * (p2.y() - p0.y()) - (p2.x() - p0.x()) * (p1.y() - p0.y());
+		if (0.0f == area)
+			return;
+		if (area < 0.0f)
+			std::swap(p0, p1);
+
+		const float max_z = std::max({ p0.z(), p1.z(), p2.z() });
+		m_has_pyramid = false;
+
+		const int32_t x0 = std::max(static_cast<int32_t>(std::floor(std::min({ p0.x(), p1.x(), p2.x() }))), 0);
+		const int32_t y0 = std::max(static_cast<int32_t>(std::floor(std::min({ p0.y(), p1.y(), p2.y() }))), 0);
+		const int32_t x1 = std::min(static_cast<int32_t>(std::ceil(std::max({ p0.x(), p1.x(), p2.x() }))), static_cast<int32_t>(m_width));
+		const int32_t y1 = std::min(static_cast<int32_t>(std::ceil(std::max({ p0.y(), p1.y(), p2.y() }))), static_cast<int32_t>(m_height));
+
+		//edge functions e(x, y) = a * x + b * y + c, inside if all >= 0.
+		//Sampled at pixel centers with the edges moved in by half a pixel:
+		//only pixels the occluder covers completely get its depth
+		const Vector3f* edges[3][2] = { { &p0, &p1 }, { &p1, &p2 }, { &p2, &p0 } };
+		float a[3], b[3], c[3];
+		for (int iEdge = 0; iEdge < 3; iEdge++) {
+			const Vector3f& from = *edges[iEdge][0];
+			const Vector3f& to = *edges[iEdge][1];
+
+			a[iEdge] = from.y() - to.y();
+			b[iEdge] = to.x() - from.x();
+			c[iEdge] = -(a[iEdge] * from.x() + b[iEdge] * from.y());
+			c[iEdge] += 0.5f * (a[iEdge] + b[iEdge]);
+			c[iEdge] -= 0.5f * (std::abs(a[iEdge]) + std::abs(b[iEdge]));
+		}
+
+		for (int32_t iY = y0; iY < y1; iY++) {
+			float* row = &m_depth[iY * m_width];
+
+			float e0 = a[0] * x0 + b[0] * iY + c[0];
+			float e1 = a[1] * x0 + b[1] * iY + c[1];
+			float e2 = a[2] * x0 + b[2] * iY + c[2];
+
+			//branchless, so the compiler can vectorize it
+			for (int32_t iX = x0; iX < x1; iX++) {
+				const bool covered = (e0 >= 0.0f) & (e1 >= 0.0f) & (e2 >= 0.0f);
+				const float depth = row[iX];
+				row[iX] = covered && max_z < depth ? max_z : depth;
+
+				e0 += a[0];
+				e1 += a[1];
+				e2 += a[2];
+			}
+		}
+	}
+
+	void OcclusionBuffer::buildPyramid()
+	{
+		m_pyramid.clear();
+
+		uint32_t width = m_width;
+		uint32_t height = m_height;
+		const float* src = m_depth.data();
+
+		while (width > 1 || height > 1) {
+			tLevel level;
+			level.width = (width + 1) / 2;
+			level.height = (height + 1) / 2;
+			level.depth.resize(level.width * level.height);
+
+			//odd sizes: the last texel covers only the remaining row/column
+			for (uint32_t iY = 0; iY < level.height; iY++) {
+				const uint32_t y0 = iY * 2;
+				const uint32_t y1 = std::min(y0 + 1, height - 1);
+
+				for (uint32_t iX = 0; iX < level.width; iX++) {
+					const uint32_t x0 = iX * 2;
+					const uint32_t x1 = std::min(x0 + 1, width - 1);
+
+					level.depth[iY * level.width + iX] = std::max({
+						src[y0 * width + x0], src[y0 * width + x1],
+						src[y1 * width + x0], src[y1 * width + x1] });
+				}
+			}
+
+			m_pyramid.push_back(std::move(level));
+			width = m_pyramid.back().width;
+			height = m_pyramid.back().height;
+			src = m_pyramid.back().depth.data();
+		}
+
+		m_has_pyramid = true;
+	}
+
+	bool OcclusionBuffer::isVisible(const Vector3f& aMin, const Vector3f& aMax) const
+	{
+		Vector4f corners[8];
+
+		for (int iCorner = 0; iCorner < 8; iCorner++) {
+			const Vector4f corner(
+				(iCorner & 0x1) ? aMax.x() : aMin.x(),
+				(iCorner & 0x2) ? aMax.y() : aMin.y(),
+				(iCorner & 0x4) ? aMax.z() : aMin.z(),
+				1.0f);
+			corners[iCorner] = m_view * corner;
+		}
+
+		return impl_isRectVisible(corners);
+	}
+
+	bool OcclusionBuffer::isVisibleSphere(const Vector3f& aCenter, float aRadius) const
+	{
+		//the box around the sphere projects to a rect enclosing the sphere
+		Vector4f corners[8];
+
+		for (int iCorner = 0; iCorner < 8; iCorner++) {
+			corners[iCorner] = Vector4f(
+				aCenter.x() + ((iCorner & 0x1) ? aRadius : -aRadius),
+				aCenter.y() + ((iCorner & 0x2) ? aRadius : -aRadius),
+				aCenter.z() + ((iCorner & 0x4) ? aRadius : -aRadius),
+				1.0f);
+		}
+
+		return impl_isRectVisible(corners);
+	}
+
+	bool OcclusionBuffer::impl_isRectVisible(const Vector4f* aCameraCorners) const
+	{
+		float min_x = numeric_limits<float>::max();
+		float min_y = numeric_limits<float>::max();
+		float max_x = -numeric_limits<float>::max();
+		float max_y = -numeric_limits<float>::max();
+		float min_z = numeric_limits<float>::max();
+
+		for (int iCorner = 0; iCorner < 8; iCorner++) {
+			//box reaches the camera plane: can't be rejected
+			if (aCameraCorners[iCorner].z() <= 0.0f)
+				return true;
+
+			const Vector3f projected = project(aCameraCorners[iCorner]);
+			min_x = std::min(min_x, projected.x());
+			min_y = std::min(min_y, projected.y());
+			max_x = std::max(max_x, projected.x());
+			max_y = std::max(max_y, projected.y());
+			min_z = std::min(min_z, projected.z());
+		}
+
+		int32_t x0 = std::max(static_cast<int32_t>(std::floor(min_x)), 0);
+		int32_t y0 = std::max(static_cast<int32_t>(std::floor(min_y)), 0);
+		int32_t x1 = std::min(static_cast<int32_t>(std::ceil(max_x)), static_cast<int32_t>(m_width));
+		int32_t y1 = std::min(static_cast<int32_t>(std::ceil(max_y)), static_cast<int32_t>(m_height));
+
+		//coarsest level where the rect spans at most 2 texels per axis
+		const float* depth = m_depth.data();
+		uint32_t width = m_width;
+
+		if (m_has_pyramid && x1 > x0 && y1 > y0) {
+			size_t level = 0;
+			while (level < m_pyramid.size() && (((x1 - 1) >> level) - (x0 >> level) > 1 || ((y1 - 1) >> level) - (y0 >> level) > 1)) {
+				level++;
+			}
+
+			if (level > 0) {
+				const tLevel& texels = m_pyramid[level - 1];
+				depth = texels.depth.data();
+				width = texels.width;
+
+				x0 >>= level;
+				y0 >>= level;
+				x1 = ((x1 - 1) >> level) + 1;
+				y1 = ((y1 - 1) >> level) + 1;
+			}
+		}
+
+		//visible if any occluder in the rect is behind the nearest box point
+		for (int32_t iY = y0; iY < y1; iY++) {
+			const float* row = &depth[iY * width];
+
+			bool any_behind = false;
+			for (int32_t iX = x0; iX < x1; iX++) {
+				any_behind |= row[iX] > min_z;
+			}
+
+			if (any_behind)
+				return true;
+		}
+
+		return false;
+	}
+
+	uint32_t OcclusionBuffer::width() const
+	{
+		return m_width;
+	}
+
+	uint32_t OcclusionBuffer::height() const
+	{
+		return m_height;
+	}
+
+	const float* OcclusionBuffer::depth() const
+	{
+		return m_depth.data();
+	}
+}
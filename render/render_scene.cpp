@@ -0,0 +1,232 @@
+#include "render_scene.h"
+#include "render_occlusion.h"
+#include <algorithm>
+
+namespace SoftRender
+{
+	//---------------------------------------------------------
+	// StaticScene
+	//---------------------------------------------------------
+	uint32_t StaticScene::add(const tMesh& aMesh, const Matrix4f& aTransform, tPipelineHandle aPipeline)
+	{
+		tObject object;
+		object.mesh = &aMesh;
+		object.transform = aTransform;
+		object.pipeline = aPipeline;
+
+		//world box from the 8 transformed corners of the mesh box
+		const tBounds& bounds = aMesh.bounds;
+		for (int iCorner = 0; iCorner < 8; iCorner++) {
+			const Vector4f corner(
+				(iCorner & 0x1) ? bounds.max.x() : bounds.min.x(),
+				(iCorner & 0x2) ? bounds.max.y() : bounds.min.y(),
+				(iCorner & 0x4) ? bounds.max.z() : bounds.min.z(),
+				1.0f);
+			const Vector3f world = (aTransform * corner).head<3>();
+
+			object.min = 0 == iCorner ? world : object.min.cwiseMin(world);
+			object.max = 0 == iCorner ? world : object.max.cwiseMax(world);
+		}
+
+		m_objects.push_back(object);
+		m_is_built = false;
+
+		return static_cast<uint32_t>(m_objects.size() - 1);
+	}
+
+	void StaticScene::build()
+	{
+		m_order.resize(m_objects.size());
+		for (uint32_t iObject = 0; iObject < m_order.size(); iObject++) {
+			m_order[iObject] = iObject;
+		}
+
+		m_nodes.clear();
+		m_nodes.reserve(2 * m_objects.size());
+		m_nodes.push_back(tNode());
+
+		if (!m_objects.empty())
+			impl_build(0, 0, static_cast<uint32_t>(m_objects.size()));
+
+		m_is_built = true;
+	}
+
+	void StaticScene::impl_build(uint32_t aNode, uint32_t aFirst, uint32_t aCount)
+	{
+		Vector3f min = m_objects[m_order[aFirst]].min;
+		Vector3f max = m_objects[m_order[aFirst]].max;
+		Vector3f centroid_min = (min + max) * 0.5f;
+		Vector3f centroid_max = centroid_min;
+
+		for (uint32_t iIdx = aFirst; iIdx < aFirst + aCount; iIdx++) {
+			const tObject& object = m_objects[m_order[iIdx]];
+			const Vector3f centroid = (object.min + object.max) * 0.5f;
+
+			min = min.cwiseMin(object.min);
+			max = max.cwiseMax(object.max);
+			centroid_min = centroid_min.cwiseMin(centroid);
+			centroid_max = centroid_max.cwiseMax(centroid);
+		}
+
+		m_nodes[aNode].min = min;
+		m_nodes[aNode].max = max;
+
+		if (aCount <= MAX_LEAF_OBJECTS) {
+			m_nodes[aNode].first = aFirst;
+			m_nodes[aNode].count = aCount;
+			return;
+		}
+
+		//median split along the longest centroid axis
+		int axis = 0;
+		const Vector3f extent = centroid_max - centroid_min;
+		if (extent.y() > extent[axis])
+			axis = 1;
+		if (extent.z() > extent[axis])
+			axis = 2;
+
+		const uint32_t half = aCount / 2;
+		std::nth_element(m_order.begin() + aFirst, m_order.begin() + aFirst + half, m_order.begin() + aFirst + aCount,
+			[this, axis](uint32_t aLeft, uint32_t aRight) {
+				return (m_objects[aLeft].min[axis] + m_objects[aLeft].max[axis]) < (m_objects[aRight].min[axis] + m_objects[aRight].max[axis]);
+			});
+
+		const uint32_t left = static_cast<uint32_t>(m_nodes.size());
+		m_nodes.push_back(tNode());
+		m_nodes.push_back(tNode());
+
+		m_nodes[aNode].first = left;
+		m_nodes[aNode].count = 0;
+
+		impl_build(left, aFirst, half);
+		impl_build(left + 1, aFirst + half, aCount - half);
+	}
+
+	void StaticScene::query(const tFrustum& aFrustum, vector<uint32_t>& aVisible, const OcclusionBuffer* aOcclusion) const
+	{
+		aVisible.clear();
+
+		if (!m_is_built)
+			throw "StaticScene::build() has to be called before query()";
+		if (m_objects.empty())
+			return;
+
+		uint32_t stack[64];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size > 0) {
+			const uint32_t node_idx = stack[--stack_size];
+			const tNode& node = m_nodes[node_idx];
+
+			if (aOcclusion && !aOcclusion->isVisible(node.min, node.max))
+				continue;
+
+			switch (aFrustum.classify_aabb(node.min, node.max))
+			{
+			case eCoverage::OUTSIDE:
+				continue;
+			case eCoverage::INSIDE:
+				//whole subtree visible, no more plane tests
+				impl_collect(node_idx, aVisible, aOcclusion);
+				continue;
+			case eCoverage::INTERSECTS:
+				break;
+			}
+
+			if (node.count > 0) {
+				for (uint32_t iIdx = node.first; iIdx < node.first + node.count; iIdx++) {
+					const tObject& object = m_objects[m_order[iIdx]];
+					if (!aFrustum.intersects_aabb(object.min, object.max))
+						continue;
+					if (aOcclusion && !aOcclusion->isVisible(object.min, object.max))
+						continue;
+
+					aVisible.push_back(m_order[iIdx]);
+				}
+			}
+			else {
+				stack[stack_size++] = node.first;
+				stack[stack_size++] = node.first + 1;
+			}
+		}
+	}
+
+	void StaticScene::impl_collect(uint32_t aNode, vector<uint32_t>& aVisible, const OcclusionBuffer* aOcclusion) const
+	{
+		const tNode& node = m_nodes[aNode];
+
+		if (aOcclusion && !aOcclusion->isVisible(node.min, node.max))
+			return;
+
+		if (node.count > 0) {
+			for (uint32_t iIdx = node.first; iIdx < node.first + node.count; iIdx++) {
+				const tObject& object = m_objects[m_order[iIdx]];
+				if (aOcclusion && !aOcclusion->isVisible(object.min, object.max))
+					continue;
+
+				aVisible.push_back(m_order[iIdx]);
+			}
+			return;
+		}
+
+		impl_collect(node.first, aVisible, aOcclusion);
+		impl_collect(node.first + 1, aVisible, aOcclusion);
+	}
+
+	size_t StaticScene::size() const
+	{
+		return m_objects.size();
+	}
+
+	const StaticScene::tObject& StaticScene::object(uint32_t aIdx) const
+	{
+		return m_objects[aIdx];
+	}
+
+	//---------------------------------------------------------
+	// StaticGeometry
+	//---------------------------------------------------------
+	void StaticGeometry::add(const tMesh& aMesh, const Matrix4f& aTransform, tPipelineHandle aPipeline, uint32_t aMaxTriangles, uint32_t aMaxVertices)
+	{
+		const tMeshlets meshlets = tMeshlets::build(aMesh, aMaxTriangles, aMaxVertices);
+		const bool has_mesh_colors = aMesh.triangle_colors.size() == aMesh.triangleCount();
+
+		for (const tMeshlet& iMeshlet : meshlets.meshlets) {
+			tCluster cluster;
+			cluster.first_vertex = static_cast<uint32_t>(positions.size());
+			cluster.vertex_count = iMeshlet.vertex_count;
+			cluster.first_triangle = static_cast<uint32_t>(indices.size() / 3);
+			cluster.triangle_count = iMeshlet.triangle_count;
+			cluster.pipeline = aPipeline;
+
+			//vertices used by the cluster, transformed once
+			for (uint32_t iVertex = 0; iVertex < iMeshlet.vertex_count; iVertex++) {
+				positions.push_back(aTransform * aMesh.positions[meshlets.vertices[iMeshlet.first_vertex + iVertex]]);
+			}
+
+			for (uint32_t iTriangle = 0; iTriangle < iMeshlet.triangle_count; iTriangle++) {
+				const uint32_t src = iMeshlet.first_triangle + iTriangle;
+				indices.insert(indices.end(), &meshlets.indices[src * 3], &meshlets.indices[src * 3] + 3);
+
+				colors.push_back(has_mesh_colors ? aMesh.triangle_colors[meshlets.triangles[src]] : 0);
+				has_color.push_back(has_mesh_colors ? 1 : 0);
+			}
+
+			//bounds after the transform: it may rotate and scale the normals
+			cluster.bounds = tClusterBounds::from_triangles(&positions[cluster.first_vertex], cluster.vertex_count, &indices[cluster.first_triangle * 3], cluster.triangle_count);
+
+			m_clusters.push_back(cluster);
+		}
+	}
+
+	size_t StaticGeometry::clusterCount() const
+	{
+		return m_clusters.size();
+	}
+
+	const StaticGeometry::tCluster& StaticGeometry::cluster(uint32_t aIdx) const
+	{
+		return m_clusters[aIdx];
+	}
+}
@@ -0,0 +1,98 @@
+#include "render_scenegraph.h"
+#include <algorithm>
+
+namespace SoftRender
+{
+	tNodeHandle SceneGraph::add(const Matrix4f& aLocal, tNodeHandle aParent)
+	{
+		if (NO_PARENT != aParent && aParent >= size())
+			throw "scene graph parent does not exist";
+
+		const tNodeHandle node = static_cast<tNodeHandle>(size());
+		const uint32_t depth = NO_PARENT == aParent ? 0 : m_depth[aParent] + 1;
+
+		m_local.push_back(aLocal);
+		m_world.push_back(aLocal);
+		m_parent.push_back(aParent);
+		m_dirty.push_back(1);
+		m_depth.push_back(depth);
+
+		if (m_levels.size() <= depth)
+			m_levels.resize(depth + 1);
+		m_levels[depth].push_back(node);
+
+		m_any_dirty = true;
+		return node;
+	}
+
+	void SceneGraph::setLocal(tNodeHandle aNode, const Matrix4f& aLocal)
+	{
+		m_local[aNode] = aLocal;
+		m_dirty[aNode] = 1;
+		m_any_dirty = true;
+	}
+
+	const Matrix4f& SceneGraph::local(tNodeHandle aNode) const
+	{
+		return m_local[aNode];
+	}
+
+	const Matrix4f& SceneGraph::world(tNodeHandle aNode) const
+	{
+		return m_world[aNode];
+	}
+
+	tNodeHandle SceneGraph::parent(tNodeHandle aNode) const
+	{
+		return m_parent[aNode];
+	}
+
+	size_t SceneGraph::size() const
+	{
+		return m_local.size();
+	}
+
+	void SceneGraph::update(Executor* aPool)
+	{
+		if (!m_any_dirty)
+			return;
+
+		//parents come first, so one pass hands the flag down to all descendants
+		for (size_t iNode = 0; iNode < size(); iNode++) {
+			const tNodeHandle parent = m_parent[iNode];
+			if (NO_PARENT != parent && m_dirty[parent])
+				m_dirty[iNode] = 1;
+		}
+
+		if (!aPool || size() < PARALLEL_MIN_NODES) {
+			for (tNodeHandle iNode = 0; iNode < size(); iNode++) {
+				impl_updateNode(iNode);
+			}
+		}
+		else {
+			//a level only reads the world matrices of the finished level above
+			for (const vector<tNodeHandle>& iLevel : m_levels) {
+				aPool->parallel_for(0, iLevel.size(), PARALLEL_MIN_NODES / 4, [this, &iLevel](size_t aBegin, size_t aEnd) {
+					for (size_t iNode = aBegin; iNode < aEnd; iNode++) {
+						impl_updateNode(iLevel[iNode]);
+					}
+				});
+			}
+		}
+
+		std::fill(m_dirty.begin(), m_dirty.end(), 0);
+		m_any_dirty = false;
+	}
+
+	void SceneGraph::impl_updateNode(tNodeHandle aNode)
+	{
+		if (!m_dirty[aNode])
+			return;
+
+		const tNodeHandle parent = m_parent[aNode];
+		if (NO_PARENT == parent)
+			m_world[aNode] = m_local[aNode];
+		else
+			m_world[aNode] = m_world[parent] * m_local[aNode];
+	}
+}
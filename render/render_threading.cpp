@@ -1,108 +1,1053 @@
 #include "render_threading.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <sstream>
 
-SoftRender::ThreadPool::ThreadPool()
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace
 {
-	m_max_threads = std::thread::hardware_concurrency();
-	if (m_max_threads < 1)
-		m_max_threads = 1;
-	m_next_func.resize(m_max_threads);
-	m_is_free.resize(m_max_threads);
-	m_called.resize(m_max_threads);
-	m_end_threads = false;
+	//worker index of the calling thread, -1 outside of a pool
+	thread_local const SoftRender::ThreadPool* t_pool = nullptr;
+	thread_local int t_worker = -1;
 
-	for (int iThread = 0; iThread < m_max_threads; iThread++) {
-		m_is_free[iThread] = false;
-		m_threads.push_back(thread([this, iThread]() {	
-			{
-				unique_lock lck(this->m_mutex);
-				this->m_is_free[iThread] = true;
-				this->m_cond_ready.notify_all();
+	//"0-3,8,10-11" as used by sysfs
+	std::vector<int> parse_cpu_list(const std::string& aList)
+	{
+		std::vector<int> ret;
+		std::stringstream stream(aList);
+		std::string range;
+		while (std::getline(stream, range, ',')) {
+			int first = 0;
+			int last = 0;
+			const int count = sscanf(range.c_str(), "%d-%d", &first, &last);
+			if (count < 1)
+				continue;
+			if (count < 2)
+				last = first;
+
+			for (int iCpu = first; iCpu <= last; iCpu++) {
+				ret.push_back(iCpu);
 			}
-			while (true) {	
-				{
-					unique_lock lck(this->m_mutex);
-					this->m_cond_start.wait(lck, [this, iThread]() {
-						return !this->m_is_free[iThread];
-					});	
-
-					//std::cout << "threadpool: start  " << iThread << std::endl;
-					m_called[iThread]++;
-				}
-
-				this->m_next_func[iThread]();
-
-				{
-					scoped_lock slck(this->m_mutex);
-					m_is_free[iThread] = true;
-					if (m_end_threads)
-						return;
-				}
-				m_cond_ready.notify_all();
+		}
+		return ret;
+	}
+
+	std::string read_first_line(const std::string& aPath)
+	{
+		std::ifstream file(aPath);
+		std::string line;
+		std::getline(file, line);
+		return line;
+	}
+
+	//cores this process may run on, grouped by NUMA node if aByNode. Empty if
+	//the platform does not tell
+	std::vector<int> available_cpus(bool aByNode)
+	{
+		std::vector<int> ret;
+
+#ifdef _WIN32
+		DWORD_PTR process_mask = 0;
+		DWORD_PTR system_mask = 0;
+		if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+			return ret;
+
+		ULONG highest_node = 0;
+		if (!aByNode || !GetNumaHighestNodeNumber(&highest_node))
+			highest_node = 0;
+
+		for (ULONG iNode = 0; iNode <= highest_node; iNode++) {
+			ULONGLONG node_mask = ~0ull;
+			if (aByNode && !GetNumaNodeProcessorMask(static_cast<UCHAR>(iNode), &node_mask))
+				continue;
+
+			for (int iCpu = 0; iCpu < static_cast<int>(sizeof(DWORD_PTR) * 8); iCpu++) {
+				if ((process_mask & node_mask) & (DWORD_PTR(1) << iCpu))
+					ret.push_back(iCpu);
 			}
-		}));
+		}
+#elif defined(__linux__)
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (0 != sched_getaffinity(0, sizeof(allowed), &allowed))
+			return ret;
+
+		std::vector<int> cpus;
+		if (aByNode) {
+			//nodes in order, each with its cores
+			for (int iNode : parse_cpu_list(read_first_line("/sys/devices/system/node/online"))) {
+				const auto node_cpus = parse_cpu_list(read_first_line("/sys/devices/system/node/node" + std::to_string(iNode) + "/cpulist"));
+				cpus.insert(cpus.end(), node_cpus.begin(), node_cpus.end());
+			}
+		}
+		if (cpus.empty()) {
+			for (int iCpu = 0; iCpu < CPU_SETSIZE; iCpu++) {
+				cpus.push_back(iCpu);
+			}
+		}
+
+		for (int iCpu : cpus) {
+			if (iCpu < CPU_SETSIZE && CPU_ISSET(iCpu, &allowed))
+				ret.push_back(iCpu);
+		}
+#endif
+
+		return ret;
 	}
+}
 
-	//wait until all threads are ready
-	unique_lock lck(m_mutex);
-	m_cond_ready.wait(lck, [this]() {
-		for (const auto& iIsFree : m_is_free) {
-			if (!iIsFree)
-				return false;
+bool SoftRender::SpinWait::spin()
+{
+	if (m_count < PAUSE_COUNT) {
+		//doubling pauses, so a contended line is not hammered
+		for (int iPause = 0; iPause <= (m_count & 0x7); iPause++) {
+			cpu_pause();
 		}
-		return true;
-	});
+	}
+	else if (m_count < PAUSE_COUNT + YIELD_COUNT) {
+		std::this_thread::yield();
+	}
+	else {
+		return false;
+	}
+
+	m_count++;
+	return true;
 }
 
-SoftRender::ThreadPool::~ThreadPool()
+void SoftRender::SpinWait::cpu_pause()
 {
-	join();
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	std::this_thread::yield();
+#endif
+}
+
+SoftRender::Task::Task(Task&& aOther) noexcept
+	: m_ops(aOther.m_ops)
+{
+	if (m_ops)
+		m_ops->move(&aOther.m_storage, &m_storage);
+	aOther.m_ops = nullptr;
+}
+
+SoftRender::Task& SoftRender::Task::operator=(Task&& aOther) noexcept
+{
+	if (this != &aOther) {
+		*this = nullptr;
+		m_ops = aOther.m_ops;
+		if (m_ops)
+			m_ops->move(&aOther.m_storage, &m_storage);
+		aOther.m_ops = nullptr;
+	}
+	return *this;
+}
+
+SoftRender::Task& SoftRender::Task::operator=(std::nullptr_t)
+{
+	if (m_ops)
+		m_ops->destroy(&m_storage);
+	m_ops = nullptr;
+	return *this;
+}
 
-	m_end_threads = true;
+SoftRender::Task::~Task()
+{
+	*this = nullptr;
+}
+
+void SoftRender::Task::operator()()
+{
+	m_ops->call(&m_storage);
+}
+
+SoftRender::Task::operator bool() const
+{
+	return nullptr != m_ops;
+}
+
+SoftRender::WorkQueue::WorkQueue()
+{
+	m_tasks.resize(CAPACITY);
+}
+
+void SoftRender::WorkQueue::lock()
+{
+	while (m_lock.test_and_set(std::memory_order_acquire)) {
+		std::this_thread::yield();
+	}
+}
+
+void SoftRender::WorkQueue::unlock()
+{
+	m_lock.clear(std::memory_order_release);
+}
+
+bool SoftRender::WorkQueue::push(Task& aTask)
+{
+	lock();
+	const bool is_full = m_tail - m_head >= CAPACITY;
+	if (!is_full) {
+		m_tasks[m_tail % CAPACITY] = std::move(aTask);
+		m_tail++;
+	}
+	unlock();
+
+	return !is_full;
+}
+
+bool SoftRender::WorkQueue::pop(Task& aTask)
+{
+	lock();
+	const bool is_empty = m_tail == m_head;
+	if (!is_empty) {
+		m_tail--;
+		aTask = std::move(m_tasks[m_tail % CAPACITY]);
+	}
+	unlock();
+
+	return !is_empty;
+}
+
+bool SoftRender::WorkQueue::steal(Task& aTask)
+{
+	lock();
+	const bool is_empty = m_tail == m_head;
+	if (!is_empty) {
+		aTask = std::move(m_tasks[m_head % CAPACITY]);
+		m_head++;
+	}
+	unlock();
+
+	return !is_empty;
+}
+
+SoftRender::tPoolOptions& SoftRender::tPoolOptions::threads(int aThreadCount)
+{
+	m_threads = aThreadCount;
+	return *this;
+}
+
+SoftRender::tPoolOptions& SoftRender::tPoolOptions::pin(bool aPin)
+{
+	m_pin = aPin;
+	return *this;
+}
+
+SoftRender::tPoolOptions& SoftRender::tPoolOptions::numa_order(bool aNumaOrder)
+{
+	m_numa_order = aNumaOrder;
+	return *this;
+}
+
+SoftRender::ThreadPool::ThreadPool(int aThreadCount)
+	: ThreadPool(tPoolOptions().threads(aThreadCount))
+{
+}
+
+SoftRender::ThreadPool::ThreadPool(const tPoolOptions& aOptions)
+	: m_options(aOptions)
+{
+	m_max_threads = aOptions.m_threads > 0 ? aOptions.m_threads : static_cast<int>(std::thread::hardware_concurrency());
+	if (m_max_threads < 1)
+		m_max_threads = 1;
 
+	if (aOptions.m_pin) {
+		//more workers than cores share them round robin
+		const auto cpus = available_cpus(aOptions.m_numa_order);
+		for (int iThread = 0; iThread < m_max_threads && !cpus.empty(); iThread++) {
+			m_cpus.push_back(cpus[iThread % cpus.size()]);
+		}
+	}
+
+	m_private_queued = make_unique<atomic<int>[]>(m_max_threads);
 	for (int iThread = 0; iThread < m_max_threads; iThread++) {
-		m_next_func[iThread] = []() -> void {
-			return;
-		};
-		m_is_free[iThread] = false;
+		m_queues.push_back(make_unique<WorkQueue>());
+		m_private.push_back(make_unique<WorkQueue>());
+		m_private_queued[iThread] = 0;
 	}
+}
 
-	m_cond_start.notify_all();
+void SoftRender::ThreadPool::impl_start()
+{
+	scoped_lock lck(m_mutex);
+	if (m_is_started)
+		return;
 
 	for (int iThread = 0; iThread < m_max_threads; iThread++) {
-		m_threads[iThread].join();
+		m_threads.push_back(thread([this, iThread]() {
+			impl_worker(iThread);
+		}));
+	}
+	m_is_started = true;
+}
+
+SoftRender::ThreadPool::~ThreadPool()
+{
+	join();
+
+	{
+		scoped_lock lck(m_mutex);
+		m_end_threads = true;
+	}
+	m_cond_work.notify_all();
+
+	for (auto& iThread : m_threads) {
+		iThread.join();
+	}
+}
+
+void SoftRender::ThreadPool::add(Task aFunction)
+{
+	if (!m_is_started)
+		impl_start();
+
+	m_pending++;
+
+	//workers keep their own tasks local, other threads spread them
+	const int first = t_pool == this ? t_worker : static_cast<int>(m_next_queue++ % m_max_threads);
+
+	bool is_queued = false;
+	for (int iQueue = 0; iQueue < m_max_threads && !is_queued; iQueue++) {
+		is_queued = m_queues[(first + iQueue) % m_max_threads]->push(aFunction);
+	}
+
+	//all queues full: run it here instead of waiting for room
+	if (!is_queued) {
+		aFunction();
+		impl_finish();
+		return;
+	}
+
+	m_queued++;
+	if (m_sleeping > 0) {
+		//taking the lock orders this with a worker about to sleep
+		{ scoped_lock lck(m_mutex); }
+		m_cond_work.notify_one();
+	}
+}
+
+void SoftRender::Executor::add_to(int, Task aFunction)
+{
+	add(std::move(aFunction));
+}
+
+void SoftRender::ThreadPool::add_to(int aWorker, Task aFunction)
+{
+	//unpinned workers move between cores anyway, so balance instead
+	if (m_cpus.empty()) {
+		add(std::move(aFunction));
+		return;
+	}
+
+	if (!m_is_started)
+		impl_start();
+
+	const int worker = aWorker % m_max_threads;
+
+	//already there, and waiting for its own queue would never end
+	if (t_pool == this && t_worker == worker) {
+		aFunction();
+		return;
+	}
+
+	m_pending++;
+
+	if (!m_private[worker]->push(aFunction)) {
+		aFunction();
+		impl_finish();
+		return;
+	}
+
+	m_private_queued[worker]++;
+	if (m_sleeping > 0) {
+		//only this one worker may take it, so wake all of them
+		{ scoped_lock lck(m_mutex); }
+		m_cond_work.notify_all();
 	}
 }
 
-void SoftRender::ThreadPool::add(std::function<void()> aFunction)
+int SoftRender::ThreadPool::cpuOf(int aWorker) const
+{
+	return m_cpus.empty() ? -1 : m_cpus[aWorker % m_max_threads];
+}
+
+void SoftRender::ThreadPool::impl_pin(int aWorker)
+{
+	const int cpu = cpuOf(aWorker);
+	if (cpu < 0)
+		return;
+
+	//best effort: a failed pin leaves the worker to the OS scheduler
+#ifdef _WIN32
+	if (cpu < static_cast<int>(sizeof(DWORD_PTR) * 8))
+		SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+namespace
 {
-	int idx = 0;
-	auto check_fun = [this, &idx]() {
-		idx = 0;
-		for (; idx < m_max_threads; idx++) {
-			if (m_is_free[idx])
-				return true;
+	//state of one parallel_for, shared with its helpers: one may start after
+	//the loop returned. Recycled, so loops do not allocate once warmed up
+	struct tLoop {
+		const SoftRender::FunctionRef<void(size_t, size_t)>* func;
+		size_t begin;
+		size_t end;
+		size_t chunk;
+		size_t chunk_count;
+		std::atomic<size_t> next{ 0 };
+		std::atomic<size_t> done{ 0 };
+		std::atomic<int> refs{ 0 };
+		std::mutex done_mutex;
+		std::condition_variable done_cond;
+	};
+
+	std::mutex g_loops_mutex;
+	std::vector<std::unique_ptr<tLoop>> g_loops;	//owns all loops, free or not
+	std::vector<tLoop*> g_free_loops;
+
+	//task of a TaskGroup: the queued closure only points here, so it stays
+	//inline in the Task. Recycled like the loops
+	struct tGroupNode {
+		SoftRender::Task func;
+	};
+
+	std::mutex g_nodes_mutex;
+	std::vector<std::unique_ptr<tGroupNode>> g_nodes;	//owns all nodes, free or not
+	std::vector<tGroupNode*> g_free_nodes;
+
+	tLoop* acquire_loop()
+	{
+		std::scoped_lock lck(g_loops_mutex);
+		if (g_free_loops.empty()) {
+			g_loops.push_back(std::make_unique<tLoop>());
+			g_free_loops.reserve(g_loops.size());
+			return g_loops.back().get();
+		}
+
+		tLoop* ret = g_free_loops.back();
+		g_free_loops.pop_back();
+		return ret;
+	}
+
+	void release_loop(tLoop* aLoop)
+	{
+		if (1 != aLoop->refs--)
+			return;
+
+		std::scoped_lock lck(g_loops_mutex);
+		g_free_loops.push_back(aLoop);
+	}
+
+	tGroupNode* acquire_node()
+	{
+		std::scoped_lock lck(g_nodes_mutex);
+		if (g_free_nodes.empty()) {
+			g_nodes.push_back(std::make_unique<tGroupNode>());
+			g_free_nodes.reserve(g_nodes.size());
+			return g_nodes.back().get();
+		}
+
+		tGroupNode* ret = g_free_nodes.back();
+		g_free_nodes.pop_back();
+		return ret;
+	}
+
+	void release_node(tGroupNode* aNode)
+	{
+		aNode->func = nullptr;
+
+		std::scoped_lock lck(g_nodes_mutex);
+		g_free_nodes.push_back(aNode);
+	}
+
+	void run_chunks(tLoop& aLoop)
+	{
+		for (size_t iChunk = aLoop.next++; iChunk < aLoop.chunk_count; iChunk = aLoop.next++) {
+			const size_t begin = aLoop.begin + iChunk * aLoop.chunk;
+			(*aLoop.func)(begin, std::min(begin + aLoop.chunk, aLoop.end));
+
+			if (aLoop.chunk_count == ++aLoop.done) {
+				{ std::scoped_lock lck(aLoop.done_mutex); }
+				aLoop.done_cond.notify_all();
+			}
 		}
+	}
+}
+
+SoftRender::TaskHandle SoftRender::Executor::spawn(Task aFunction)
+{
+	TaskHandle ret;
+	ret.m_executor = this;
+	ret.m_state = TaskHandle::impl_acquire();
+	ret.m_state->func = std::move(aFunction);
+	ret.m_state->refs = 2;
+
+	add([state = ret.m_state]() {
+		state->func();
+		state->func = nullptr;
+
+		state->is_done = true;
+		{ scoped_lock lck(state->done_mutex); }
+		state->done_cond.notify_all();
+		TaskHandle::impl_release(state);
+	});
+
+	return ret;
+}
+
+bool SoftRender::Executor::try_run_one()
+{
+	return false;
+}
+
+bool SoftRender::ThreadPool::try_run_one()
+{
+	const bool is_worker = t_pool == this;
+	const int worker = is_worker ? t_worker : static_cast<int>(m_next_queue % m_max_threads);
+
+	Task task;
+	if (!impl_take(worker, is_worker, task))
 		return false;
-	};
 
-	unique_lock lck(m_mutex);
-	m_cond_ready.wait(lck, check_fun);
-	m_next_func[idx] = aFunction;
-	m_is_free[idx] = false;
-	lck.unlock();
-	m_cond_start.notify_all();
+	task();
+	impl_finish();
+	return true;
 }
 
 void SoftRender::ThreadPool::join()
 {
-	auto check_fun = [this]() {
-		for (int i=0; i < m_max_threads; i++) {
-			if (!m_is_free[i])
-				return false;
+	unique_lock lck(m_mutex);
+	m_cond_done.wait(lck, [this]() {
+		return 0 == m_pending;
+	});
+}
+
+int SoftRender::ThreadPool::threadCount() const
+{
+	return m_max_threads;
+}
+
+void SoftRender::Executor::parallel_for(size_t aBegin, size_t aEnd, size_t aGrain, FunctionRef<void(size_t, size_t)> aFunc)
+{
+	if (aEnd <= aBegin)
+		return;
+
+	//a few chunks per worker, so faster workers can take more of them
+	const size_t count = aEnd - aBegin;
+	const size_t chunk = std::max(std::max(aGrain, size_t(1)), count / (threadCount() * 4));
+	const size_t chunk_count = (count + chunk - 1) / chunk;
+
+	if (1 == chunk_count) {
+		aFunc(aBegin, aEnd);
+		return;
+	}
+
+	const size_t helpers = std::min(chunk_count - 1, static_cast<size_t>(threadCount()));
+
+	//aFunc is only called for chunks this call waits for, so a helper
+	//that starts late never touches it
+	tLoop* loop = acquire_loop();
+	loop->func = &aFunc;
+	loop->begin = aBegin;
+	loop->end = aEnd;
+	loop->chunk = chunk;
+	loop->chunk_count = chunk_count;
+	loop->next = 0;
+	loop->done = 0;
+	loop->refs = static_cast<int>(helpers) + 1;
+
+	for (size_t iHelper = 0; iHelper < helpers; iHelper++) {
+		add([loop]() {
+			run_chunks(*loop);
+			release_loop(loop);
+		});
+	}
+
+	run_chunks(*loop);
+
+	{
+		unique_lock lck(loop->done_mutex);
+		loop->done_cond.wait(lck, [loop]() {
+			return loop->done == loop->chunk_count;
+		});
+	}
+	release_loop(loop);
+}
+
+void SoftRender::Executor::parallel_for_tiles(uint32_t aWidth, uint32_t aHeight, uint32_t aTileWidth, uint32_t aTileHeight, FunctionRef<void(uint32_t, uint32_t, uint32_t, uint32_t)> aFunc)
+{
+	const uint32_t tiles_x = (aWidth + aTileWidth - 1) / aTileWidth;
+	const uint32_t tiles_y = (aHeight + aTileHeight - 1) / aTileHeight;
+
+	parallel_for(0, static_cast<size_t>(tiles_x) * tiles_y, 1, [&](size_t aFirst, size_t aLast) {
+		for (size_t iTile = aFirst; iTile < aLast; iTile++) {
+			const uint32_t x0 = static_cast<uint32_t>(iTile % tiles_x) * aTileWidth;
+			const uint32_t y0 = static_cast<uint32_t>(iTile / tiles_x) * aTileHeight;
+
+			aFunc(x0, y0, std::min(x0 + aTileWidth, aWidth), std::min(y0 + aTileHeight, aHeight));
 		}
+	});
+}
+
+bool SoftRender::ThreadPool::impl_take(int aWorker, bool aIsOwner, Task& aTask)
+{
+	//placed tasks first and in the order they were added
+	if (aIsOwner && m_private_queued[aWorker] > 0 && m_private[aWorker]->steal(aTask)) {
+		m_private_queued[aWorker]--;
 		return true;
+	}
+
+	bool is_taken = m_queues[aWorker]->pop(aTask);
+	for (int iVictim = 1; iVictim < m_max_threads && !is_taken; iVictim++) {
+		is_taken = m_queues[(aWorker + iVictim) % m_max_threads]->steal(aTask);
+	}
+
+	if (is_taken)
+		m_queued--;
+	return is_taken;
+}
+
+void SoftRender::ThreadPool::impl_finish()
+{
+	if (1 == m_pending--) {
+		{ scoped_lock lck(m_mutex); }
+		m_cond_done.notify_all();
+	}
+}
+
+void SoftRender::ThreadPool::impl_worker(int aWorker)
+{
+	t_pool = this;
+	t_worker = aWorker;
+	impl_pin(aWorker);
+
+	Task task;
+	auto has_work = [this, aWorker]() {
+		return m_queued > 0 || m_private_queued[aWorker] > 0;
 	};
 
-	unique_lock lck(m_mutex);
-	m_cond_ready.wait(lck, check_fun);
+	while (true) {
+		if (impl_take(aWorker, true, task)) {
+			task();
+			task = nullptr;
+			impl_finish();
+			continue;
+		}
+
+		//new work usually follows soon within a frame
+		SpinWait spin;
+		while (!has_work() && spin.spin());
+		if (has_work())
+			continue;
+
+		unique_lock lck(m_mutex);
+		m_sleeping++;
+		m_cond_work.wait(lck, [this, &has_work]() {
+			return has_work() || m_end_threads;
+		});
+		m_sleeping--;
+
+		if (m_end_threads && !has_work())
+			return;
+	}
+}
+
+std::mutex SoftRender::TaskHandle::s_states_mutex;
+std::vector<std::unique_ptr<SoftRender::TaskHandle::tState>> SoftRender::TaskHandle::s_states;
+std::vector<SoftRender::TaskHandle::tState*> SoftRender::TaskHandle::s_free_states;
+
+SoftRender::TaskHandle::TaskHandle(const TaskHandle& aOther)
+	: m_executor(aOther.m_executor), m_state(aOther.m_state)
+{
+	if (m_state)
+		m_state->refs++;
+}
+
+SoftRender::TaskHandle& SoftRender::TaskHandle::operator=(const TaskHandle& aOther)
+{
+	if (aOther.m_state)
+		aOther.m_state->refs++;
+	if (m_state)
+		impl_release(m_state);
+
+	m_executor = aOther.m_executor;
+	m_state = aOther.m_state;
+	return *this;
+}
+
+SoftRender::TaskHandle::~TaskHandle()
+{
+	if (m_state)
+		impl_release(m_state);
+}
+
+SoftRender::TaskHandle::tState* SoftRender::TaskHandle::impl_acquire()
+{
+	scoped_lock lck(s_states_mutex);
+	if (s_free_states.empty()) {
+		s_states.push_back(make_unique<tState>());
+		s_free_states.reserve(s_states.size());
+		return s_states.back().get();
+	}
+
+	tState* ret = s_free_states.back();
+	s_free_states.pop_back();
+	ret->is_done = false;
+	return ret;
+}
+
+void SoftRender::TaskHandle::impl_release(tState* aState)
+{
+	if (1 != aState->refs--)
+		return;
+
+	//the task is done with it as well: wait() has nothing left to read
+	scoped_lock lck(s_states_mutex);
+	s_free_states.push_back(aState);
+}
+
+void SoftRender::TaskHandle::wait()
+{
+	if (!m_state)
+		return;
+
+	SpinWait spin;
+	while (!m_state->is_done) {
+		if (m_executor->try_run_one() || spin.spin())
+			continue;
+
+		//nothing left to help with: the task runs on another thread
+		unique_lock lck(m_state->done_mutex);
+		m_state->done_cond.wait(lck, [this]() {
+			return m_state->is_done.load();
+		});
+	}
+}
+
+bool SoftRender::TaskHandle::is_done() const
+{
+	return !m_state || m_state->is_done;
+}
+
+SoftRender::TaskGroup::TaskGroup(Executor& aExecutor)
+	: m_executor(aExecutor)
+{
+}
+
+SoftRender::TaskGroup::~TaskGroup()
+{
+	wait();
+}
+
+void SoftRender::TaskGroup::add(Task aFunction)
+{
+	tGroupNode* node = acquire_node();
+	node->func = std::move(aFunction);
+	m_pending++;
+
+	m_executor.add([this, node]() {
+		node->func();
+		release_node(node);
+
+		//under the lock: wait() may only return (and destroy the group)
+		//once this task is done touching it
+		scoped_lock lck(m_mutex);
+		if (1 == m_pending--)
+			m_cond.notify_all();
+	});
+}
+
+void SoftRender::TaskGroup::wait()
+{
+	SpinWait spin;
+	while (m_pending > 0) {
+		if (m_executor.try_run_one() || spin.spin())
+			continue;
+
+		//nothing left to help with: the group's tasks run on other threads
+		unique_lock lck(m_mutex);
+		m_cond.wait(lck, [this]() {
+			return 0 == m_pending;
+		});
+	}
+
+	//the last task may still hold the lock
+	scoped_lock lck(m_mutex);
+}
+
+bool SoftRender::TaskGroup::is_done() const
+{
+	return 0 == m_pending;
+}
+
+void SoftRender::FrameFence::reset(int aPending)
+{
+	m_pending = aPending;
+}
+
+void SoftRender::FrameFence::signal()
+{
+	//under the lock: wait() may only return (and the fence go away)
+	//once the last signal is done touching it
+	scoped_lock lck(m_mutex);
+	if (1 == m_pending--)
+		m_cond.notify_all();
+}
+
+void SoftRender::FrameFence::wait()
+{
+	SpinWait spin;
+	while (m_pending > 0) {
+		if (spin.spin())
+			continue;
+
+		unique_lock lck(m_mutex);
+		m_cond.wait(lck, [this]() {
+			return m_pending <= 0;
+		});
+	}
+
+	scoped_lock lck(m_mutex);
+}
+
+bool SoftRender::FrameFence::is_signaled()
+{
+	return m_pending <= 0;
+}
+
+SoftRender::JobGraph::~JobGraph()
+{
+	wait();
+}
+
+SoftRender::tJob SoftRender::JobGraph::add(Task aFunction, int aWorker)
+{
+	m_nodes.push_back({ std::move(aFunction), aWorker, 0, NO_EDGE });
+	return static_cast<tJob>(m_nodes.size() - 1);
+}
+
+void SoftRender::JobGraph::depend(tJob aJob, tJob aOn)
+{
+	m_edges.push_back({ aJob, m_nodes[aOn].first_dependent });
+	m_nodes[aOn].first_dependent = static_cast<uint32_t>(m_edges.size() - 1);
+	m_nodes[aJob].dependency_count++;
+}
+
+void SoftRender::JobGraph::run(Executor& aExecutor)
+{
+	if (m_nodes.empty())
+		return;
+
+	m_executor = &aExecutor;
+
+	if (m_remaining_size < m_nodes.size()) {
+		m_remaining_size = m_nodes.size();
+		m_remaining = make_unique<atomic<int>[]>(m_remaining_size);
+	}
+	for (size_t iJob = 0; iJob < m_nodes.size(); iJob++) {
+		m_remaining[iJob] = m_nodes[iJob].dependency_count;
+	}
+
+	//set before the first job can finish
+	m_pending = static_cast<int>(m_nodes.size());
+
+	for (tJob iJob = 0; iJob < m_nodes.size(); iJob++) {
+		if (0 == m_nodes[iJob].dependency_count)
+			impl_launch(iJob);
+	}
+}
+
+void SoftRender::JobGraph::impl_launch(tJob aJob)
+{
+	auto job = [this, aJob]() {
+		m_nodes[aJob].function();
+		impl_finish(aJob);
+	};
+
+	if (m_nodes[aJob].worker >= 0)
+		m_executor->add_to(m_nodes[aJob].worker, job);
+	else
+		m_executor->add(job);
+}
+
+void SoftRender::JobGraph::impl_finish(tJob aJob)
+{
+	for (uint32_t iEdge = m_nodes[aJob].first_dependent; iEdge != NO_EDGE; iEdge = m_edges[iEdge].next) {
+		const tJob dependent = m_edges[iEdge].job;
+		if (1 == m_remaining[dependent]--)
+			impl_launch(dependent);
+	}
+
+	//under the lock: wait() may only return (and the graph be reused)
+	//once this job is done touching it
+	scoped_lock lck(m_mutex);
+	if (1 == m_pending--)
+		m_cond.notify_all();
+}
+
+void SoftRender::JobGraph::wait()
+{
+	SpinWait spin;
+	while (m_pending > 0) {
+		if (m_executor->try_run_one() || spin.spin())
+			continue;
+
+		unique_lock lck(m_mutex);
+		m_cond.wait(lck, [this]() {
+			return 0 == m_pending;
+		});
+	}
+
+	scoped_lock lck(m_mutex);
+}
+
+bool SoftRender::JobGraph::is_done() const
+{
+	return 0 == m_pending;
+}
+
+void SoftRender::JobGraph::clear()
+{
+	wait();
+
+	m_nodes.clear();
+	m_edges.clear();
+}
+
+size_t SoftRender::JobGraph::size() const
+{
+	return m_nodes.size();
+}
+
+void SoftRender::JobGraph::reserve(size_t aJobs, size_t aDependencies)
+{
+	m_nodes.reserve(aJobs);
+	m_edges.reserve(aDependencies);
+
+	if (m_remaining_size < aJobs) {
+		m_remaining_size = aJobs;
+		m_remaining = make_unique<atomic<int>[]>(m_remaining_size);
+	}
+}
+
+void SoftRender::InlineExecutor::add(Task aFunction)
+{
+	aFunction();
+}
+
+int SoftRender::InlineExecutor::threadCount() const
+{
+	return 1;
+}
+
+SoftRender::ParallelismController::ParallelismController(int aMaxWorkers)
+{
+	aMaxWorkers = std::max(aMaxWorkers, 1);
+	for (int iWorkers = 1; iWorkers < aMaxWorkers; iWorkers *= 2) {
+		m_models.push_back(tModel());
+		m_models.back().workers = iWorkers;
+	}
+	m_models.push_back(tModel());
+	m_models.back().workers = aMaxWorkers;
+}
+
+void SoftRender::ParallelismController::setFixed(int aWorkers)
+{
+	scoped_lock lck(m_mutex);
+	m_fixed = std::clamp(aWorkers, 0, m_models.back().workers);
+}
+
+int SoftRender::ParallelismController::choose(double aWork)
+{
+	scoped_lock lck(m_mutex);
+	if (m_fixed > 0)
+		return m_fixed;
+
+	//measure every candidate a few times first
+	for (const tModel& iModel : m_models) {
+		if (iModel.samples < MIN_SAMPLES)
+			return iModel.workers;
+	}
+
+	size_t best = 0;
+	double best_time = numeric_limits<double>::max();
+	for (size_t iModel = 0; iModel < m_models.size(); iModel++) {
+		const double time = impl_predict(m_models[iModel], aWork);
+		if (time < best_time) {
+			best_time = time;
+			best = iModel;
+		}
+	}
+
+	//the loads change: once in a while try one step fewer or more
+	m_choices++;
+	if (0 == m_choices % EXPLORE_INTERVAL) {
+		const bool is_down = 0 == (m_choices / EXPLORE_INTERVAL) % 2;
+		if (is_down && best > 0)
+			best--;
+		else if (!is_down && best + 1 < m_models.size())
+			best++;
+	}
+
+	return m_models[best].workers;
+}
+
+void SoftRender::ParallelismController::report(int aWorkers, double aWork, double aSeconds)
+{
+	scoped_lock lck(m_mutex);
+	for (tModel& iModel : m_models) {
+		if (iModel.workers != aWorkers)
+			continue;
+
+		iModel.samples++;
+		iModel.weight = iModel.weight * DECAY + 1.0;
+		iModel.sum_work = iModel.sum_work * DECAY + aWork;
+		iModel.sum_time = iModel.sum_time * DECAY + aSeconds;
+		iModel.sum_work2 = iModel.sum_work2 * DECAY + aWork * aWork;
+		iModel.sum_work_time = iModel.sum_work_time * DECAY + aWork * aSeconds;
+		return;
+	}
+}
+
+int SoftRender::ParallelismController::maxWorkers() const
+{
+	return m_models.back().workers;
+}
+
+double SoftRender::ParallelismController::impl_predict(const tModel& aModel, double aWork) const
+{
+	const double mean_work = aModel.sum_work / aModel.weight;
+	const double mean_time = aModel.sum_time / aModel.weight;
+	const double variance = aModel.sum_work2 / aModel.weight - mean_work * mean_work;
+
+	//all samples had about the same work: scale the mean time
+	if (variance <= 1e-6 * mean_work * mean_work)
+		return mean_work > 0.0 ? mean_time * (aWork / mean_work) : mean_time;
+
+	//least squares line, a negative overhead or cost is measurement noise
+	const double cost = std::max(0.0, (aModel.sum_work_time / aModel.weight - mean_work * mean_time) / variance);
+	const double overhead = std::max(0.0, mean_time - cost * mean_work);
+	return overhead + cost * aWork;
 }